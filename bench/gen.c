@@ -0,0 +1,149 @@
+// fixture generator for make bench, the same arguments always give the same
+// tree
+// usage: gen DIR KIND N
+//   flat    N empty files
+//   mixed   N files, directories, symlinks, broken symlinks, executables and
+//           fifos of varying sizes and times
+//   utf8    N files with long multibyte names
+//   owners  N files owned by N / 8 distinct users and groups (needs root)
+//   deep    N files spread over a tree of directories 4 wide and up to 8
+//           deep, for -R
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define die(...) do { fprintf(stderr, "gen: " __VA_ARGS__); \
+	fprintf(stderr, ": %s\n", strerror(errno)); exit(1); } while (0)
+
+#define EPOCH 1577836800 // 2020-01-01, far enough back to not age
+
+static uint64_t seed = 0x9e3779b97f4a7c15;
+
+static uint32_t rnd(uint32_t n) { // xorshift64*
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (seed * 0x2545f4914f6cdd1d >> 32) % n;
+}
+
+// fixed times and sizes so that -t and -s have something to sort
+static void touch(const char *path, mode_t mode, off_t size) {
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, mode);
+	if (fd == -1) die("%s", path);
+	if (size && ftruncate(fd, size) == -1) die("%s", path);
+	struct timespec t[2] = {{ EPOCH + rnd(1 << 25), 0 }};
+	t[1] = t[0];
+	if (futimens(fd, t) == -1) die("%s", path);
+	close(fd);
+}
+
+static void flat(long n) {
+	char name[32];
+	for (long i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "file_%ld", i);
+		touch(name, 0644, 0);
+	}
+}
+
+static void mixed(long n) {
+	char name[64], target[64];
+	static const char *const ext[] = { "c", "h", "txt", "tar.gz", "png",
+		"log", "md", "so", "" };
+	for (long i = 0; i < n; i++) {
+		uint32_t k = rnd(100);
+		snprintf(name, sizeof(name), "entry-%ld%s%s", i,
+			*ext[i % 9] ? "." : "", ext[i % 9]);
+		if (k < 10) {
+			if (mkdir(name, 0755) == -1) die("%s", name);
+		} else if (k < 20) {
+			snprintf(target, sizeof(target), "entry-%u", rnd(n));
+			if (symlink(target, name) == -1) die("%s", name);
+		} else if (k < 23) {
+			if (symlink("missing", name) == -1) die("%s", name);
+		} else if (k < 24) {
+			if (mkfifo(name, 0644) == -1) die("%s", name);
+		} else {
+			touch(name, k < 30 ? 0755 : 0644, rnd(1 << 20));
+		}
+	}
+}
+
+static void utf8(long n) {
+	static const char *const parts[] = { "данные", "ファイル", "naïve",
+		"😀", "über", "测试", "résumé", "ŋ", "x" };
+	char name[256];
+	for (long i = 0; i < n; i++) {
+		int len = snprintf(name, sizeof(name), "%ld-", i);
+		for (int j = rnd(12) + 4; j--;) {
+			const char *p = parts[rnd(9)];
+			if (len + strlen(p) >= sizeof(name)) break;
+			len += snprintf(name + len, sizeof(name) - len, "%s", p);
+		}
+		touch(name, 0644, 0);
+	}
+}
+
+static void owners(long n) {
+	char name[32];
+	long ids = n / 8 + 1;
+	for (long i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "owned_%ld", i);
+		touch(name, 0644, 0);
+		if (chown(name, 1000 + rnd(ids), 1000 + rnd(ids)) == -1 &&
+		    errno != EPERM)
+			die("%s", name);
+	}
+}
+
+static long deep_left;
+
+static void deep_dir(int depth) {
+	char name[32];
+	for (int i = 0; i < 16 && deep_left > 0; i++, deep_left--) {
+		snprintf(name, sizeof(name), "f%d", i);
+		touch(name, 0644, 0);
+	}
+	for (int i = 0; i < 4 && depth < 8 && deep_left > 0; i++) {
+		snprintf(name, sizeof(name), "d%d", i);
+		if (mkdir(name, 0755) == -1 || chdir(name) == -1) die("%s", name);
+		deep_dir(depth + 1);
+		if (chdir("..") == -1) die("%s", "..");
+	}
+}
+
+static void deep(long n) {
+	deep_left = n;
+	while (deep_left > 0) {
+		char name[32];
+		snprintf(name, sizeof(name), "t%ld", deep_left);
+		if (mkdir(name, 0755) == -1 || chdir(name) == -1) die("%s", name);
+		deep_dir(0);
+		if (chdir("..") == -1) die("%s", "..");
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: gen DIR flat|mixed|utf8|owners|deep N\n");
+		return 2;
+	}
+	long n = atol(argv[3]);
+	if (mkdir(argv[1], 0755) == -1 && errno != EEXIST) die("%s", argv[1]);
+	if (chdir(argv[1]) == -1) die("%s", argv[1]);
+	if (!strcmp(argv[2], "flat")) flat(n);
+	else if (!strcmp(argv[2], "mixed")) mixed(n);
+	else if (!strcmp(argv[2], "utf8")) utf8(n);
+	else if (!strcmp(argv[2], "owners")) owners(n);
+	else if (!strcmp(argv[2], "deep")) deep(n);
+	else {
+		fprintf(stderr, "gen: unknown kind -- '%s'\n", argv[2]);
+		return 2;
+	}
+	return 0;
+}
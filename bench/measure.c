@@ -0,0 +1,70 @@
+// runs a command n times with its output discarded and prints the median,
+// minimum and standard deviation of the wall time in milliseconds and the
+// largest peak rss in kilobytes
+// usage: measure N cmd [arg ...]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int dbl_cmp(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+	int n = argc > 2 ? atoi(argv[1]) : 0;
+	if (n < 1) {
+		fprintf(stderr, "usage: measure N cmd [arg ...]\n");
+		return 2;
+	}
+	double *t = malloc(n * sizeof(*t)), sum = 0, sq = 0;
+	long rss = 0;
+	for (int i = 0; i < n; i++) {
+		double start = now();
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("measure: fork");
+			return 1;
+		}
+		if (!pid) {
+			int fd = open("/dev/null", O_WRONLY);
+			dup2(fd, STDOUT_FILENO);
+			execvp(argv[2], argv + 2);
+			fprintf(stderr, "measure: %s: %s\n", argv[2], strerror(errno));
+			_exit(127);
+		}
+		int status;
+		struct rusage ru;
+		if (wait4(pid, &status, 0, &ru) == -1) {
+			perror("measure: wait4");
+			return 1;
+		}
+		t[i] = now() - start;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+			fprintf(stderr, "measure: %s failed\n", argv[2]);
+			return 1;
+		}
+		if (ru.ru_maxrss > rss) rss = ru.ru_maxrss;
+		sum += t[i];
+		sq += t[i] * t[i];
+	}
+	qsort(t, n, sizeof(*t), dbl_cmp);
+	double mean = sum / n, var = sq / n - mean * mean;
+	double median = n % 2 ? t[n / 2] : (t[n / 2 - 1] + t[n / 2]) / 2;
+	printf("%.2f %.2f %.2f %ld\n", median, t[0], var > 0 ? sqrt(var) : 0, rss);
+	return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# benchmark lsc on generated fixtures, run through make bench
+#
+#   BENCH_DIR     where the fixtures go, preferably a tmpfs (/dev/shm/lsc-bench)
+#   BENCH_SIZES   entries of the flat fixtures (1000 100000 1000000)
+#   BENCH_N       entries of the other fixtures (100000)
+#   BENCH_REPEAT  runs per measurement (5)
+#   BENCH_OPTS    option sets, separated by spaces (-1 -g -l -s -t -y)
+#   LSC           binary to measure (./lsc)
+#   REF           reference binary, its output has to match byte for byte
+#
+# prints the median, minimum and standard deviation of the wall time in
+# milliseconds, the peak rss in kilobytes and, when strace is installed, the
+# number of system calls
+
+set -e
+bench=$(dirname "$0")
+dir=${BENCH_DIR:-/dev/shm/lsc-bench}
+sizes=${BENCH_SIZES:-1000 100000 1000000}
+n=${BENCH_N:-100000}
+repeat=${BENCH_REPEAT:-5}
+opts=${BENCH_OPTS:--1 -g -l -s -t -y}
+lsc=${LSC:-./lsc}
+
+mkdir -p "$dir"
+fs=$(stat -f -c %T "$dir")
+[ "$fs" = tmpfs ] || echo "warning: $dir is on $fs, not tmpfs" >&2
+
+fixtures=
+fixture() { # name kind n
+	if [ ! -e "$dir/$1.done" ]; then
+		rm -rf "${dir:?}/$1"
+		"$bench/gen" "$dir/$1" "$2" "$3"
+		touch "$dir/$1.done"
+	fi
+	fixtures="$fixtures $1"
+}
+for s in $sizes; do fixture "flat-$s" flat "$s"; done
+for k in mixed utf8 owners; do fixture "$k-$n" "$k" "$n"; done
+fixture "deep-$n" deep "$n"
+
+# the output depends on these, keep it the same for both binaries
+export LC_ALL=C.UTF-8 TZ=UTC
+
+syscalls() {
+	command -v strace >/dev/null || { echo -; return; }
+	strace -f -qq -o "$dir/strace.out" "$@" >/dev/null
+	grep -cv 'resumed>' "$dir/strace.out"
+}
+
+fail=0
+printf '%-14s %-4s %10s %10s %8s %9s %9s%s\n' fixture opts median min sd \
+	rss_kb syscalls "${REF:+ ref}"
+for f in $fixtures; do
+	for o in $opts; do
+		set -- "$o"
+		case $f in deep-*) set -- "$o" -R ;; esac
+		m=$("$bench/measure" "$repeat" "$lsc" "$@" "$dir/$f")
+		c=$(syscalls "$lsc" "$@" "$dir/$f")
+		r=
+		if [ -n "$REF" ]; then
+			"$lsc" "$@" "$dir/$f" > "$dir/out.new" 2>&1 || true
+			"$REF" "$@" "$dir/$f" > "$dir/out.ref" 2>&1 || true
+			if cmp -s "$dir/out.new" "$dir/out.ref"; then r=" same"
+			else r=" DIFFERS"; fail=1; fi
+		fi
+		set -- $m
+		printf '%-14s %-4s %10s %10s %8s %9s %9s%s\n' "$f" "$o" "$1" "$2" \
+			"$3" "$4" "$c" "$r"
+	done
+done
+exit $fail
@@ -9,22 +9,48 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <grp.h>
+#include <langinfo.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#if __has_include(<sys/sysmacros.h>)
+#include <sys/sysmacros.h> // makedev
+#endif
+#if __has_include(<sys/inotify.h>)
+#include <sys/inotify.h>
+#define HAVE_INOTIFY 1
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #include "config.h"
 
 #define program_name "lsc"
@@ -43,34 +69,149 @@
 #define ls_isalpha(c) (((unsigned)(c)|32)-'a' < 26)
 #define ls_isdigit(c) ((unsigned)(c)-'0' < 10)
 
+// --profile: time spent per phase, summed over the threads, and event counts
+enum prof_phase {
+	PROF_READ, PROF_STAT, PROF_READLINK, PROF_IDS, PROF_SORT, PROF_WIDTH,
+	PROF_LAYOUT, PROF_FORMAT, PROF_FLUSH, PROF_PHASES,
+};
+
+enum prof_counter {
+	PROF_ENTRIES, PROF_STATS, PROF_READLINKS, PROF_NSS_MISSES,
+	PROF_LSC_LOOKUPS, PROF_BYTES, PROF_ALLOCS, PROF_CACHE_HITS,
+	PROF_CACHE_MISSES, PROF_COUNTERS,
+};
+
+static struct {
+	bool on;
+	uint64_t ns[PROF_PHASES];
+	uint64_t n[PROF_COUNTERS];
+} prof;
+
+static uint64_t prof_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static uint64_t prof_start(void) { return prof.on ? prof_clock() : 0; }
+
+static void prof_end(enum prof_phase p, uint64_t start) {
+	if (prof.on)
+		__atomic_fetch_add(&prof.ns[p], prof_clock() - start, __ATOMIC_RELAXED);
+}
+
+static void prof_count(enum prof_counter c, uint64_t n) {
+	if (prof.on) __atomic_fetch_add(&prof.n[c], n, __ATOMIC_RELAXED);
+}
+
 static inline size_t size_mul(size_t a, size_t b) {
     if (b > 1 && SIZE_MAX / b < a) abort();
 	return a * b;
 }
 
 static inline void *xmalloc(size_t nmemb, size_t size) {
+	prof_count(PROF_ALLOCS, 1);
 	void *p = malloc(size_mul(nmemb, size));
 	assertx(p);
 	return p;
 }
 
 static inline void *xrealloc(void *p, size_t nmemb, size_t size) {
+	prof_count(PROF_ALLOCS, 1);
 	p = realloc(p, size_mul(nmemb, size));
 	assertx(p);
 	return p;
 }
 
+// bump allocator for names and link targets, chunks are kept across resets
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+	char data[];
+};
+
+// chunks up to cur are in use, the ones after it are free
+struct arena { struct arena_chunk *head, *cur; };
+
+static void *arena_alloc(struct arena *a, size_t n) {
+	struct arena_chunk *c = a->cur;
+	if (!c || c->size - c->used < n) {
+		struct arena_chunk *next = c ? c->next : a->head;
+		if (!next || next->size < n) {
+			size_t size = MAX(n, ARENA_CHUNK);
+			struct arena_chunk *nc = xmalloc(sizeof(*nc) + size, 1);
+			nc->size = size;
+			nc->next = next;
+			if (c) c->next = nc;
+			else a->head = nc;
+			next = nc;
+		}
+		next->used = 0;
+		a->cur = c = next;
+	}
+	void *p = c->data + c->used;
+	c->used += n;
+	return p;
+}
+
+static char *arena_strndup(struct arena *a, const char *s, size_t len) {
+	char *p = arena_alloc(a, len + 1);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+static void arena_reset(struct arena *a) { a->cur = 0; }
+
+static void arena_free(struct arena *a) {
+	for (struct arena_chunk *c = a->head, *next; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->head = a->cur = 0;
+}
+
+// move the chunks of a fresh arena src into a, they stay in use until a is
+// reset
+static void arena_adopt(struct arena *a, struct arena *src) {
+	if (!src->head) return;
+	struct arena_chunk *last = src->cur;
+	last->next = a->cur ? a->cur->next : a->head;
+	if (a->cur) a->cur->next = src->head;
+	else a->head = src->head;
+	a->cur = last;
+	src->head = src->cur = 0;
+}
+
 enum sort_type { SORT_FVER, SORT_SIZE, SORT_TIME };
 enum uinfo_type { UINFO_NEVER, UINFO_AUTO, UINFO_ALWAYS };
 enum date_type { DATE_NONE, DATE_REL, DATE_ABS };
+// machine readable output skips colours, widths and headers
+enum output_type { OUTPUT_TERM, OUTPUT_PRINT0, OUTPUT_JSON, OUTPUT_BINARY };
 enum layout_type { LAYOUT_GRID_COLUMNS, LAYOUT_GRID_LINES, LAYOUT_1LINE };
+enum profile_type { PROFILE_NONE, PROFILE_TEXT, PROFILE_JSON };
 
 static struct {
 	bool all;
 	bool dir;
 	bool m_time;
+	bool du; // sizes are allocated blocks, of whole subtrees for directories
 	bool stats;
+	int jobs; // stat threads, 0 picks a number per directory
+	bool uring; // stat through io_uring where the kernel allows it
+	bool recursive;
+	bool preload; // enumerate users and groups once there are many
+	enum profile_type profile;
+	bool cache; // keep directory listings in dcache_dir
+	bool watch; // follow changes to the listing, see ls_watch
+	enum output_type output;
+	size_t head; // list only the first head entries of each directory
+	const char *files_from; // list the paths in this file, see ls_files_from
+	int files_delim;
 	// sorting
+	bool unsorted; // directory order, streamed with the one line layout
 	bool no_group_dir;
 	bool reverse;
 	enum sort_type sort;
@@ -84,22 +225,26 @@ static struct {
 	bool no_classify;
 } options;
 
+// the fields sorting and the layout compare, kept small so that a long
+// listing is sorted through as few cache lines as possible
 typedef struct {
-	const char *name, *linkname;
+	const char *name;
+	off_t size;
+	time_t time;
 	mode_t mode, linkmode;
+	int name_len, name_suf;
+} file_info;
+
+// the rest of an entry, read when it is statted and formatted, see fi_cold
+typedef struct {
+	const char *linkname;
+	ino_t ino;
 	id_t uid, gid;
-	time_t time;
-	off_t size;
-	int name_len, linkname_len;
+	int linkname_len;
 	int uwidth, gwidth, nwidth;
-	int name_suf;
+	unsigned char type; // DT_* from the directory entry, DT_UNKNOWN if none
 	bool linkok;
-} file_info;
-
-static void fi_free(file_info *fi) {
-	if (fi->name) free((void *)fi->name);
-	if (fi->linkname) free((void *)fi->linkname);
-}
+} file_cold;
 
 static int order(char c) {
 	if (ls_isalpha(c)) return c;
@@ -192,10 +337,90 @@ static inline int fi_cmp(const void *va, const void *vb) {
 		b->name, b->name_len, b->name_suf);
 }
 
-// file info vector
+// sort key, if fi_key(a) < fi_key(b) then fi_cmp(a, b) < 0; entries with
+// equal keys still need fi_cmp
+// 63     directory group (0 if grouped first)
+// 62..0  size, time, or the filevercmp prefix key, mirrored for -r
+#define KEY_GROUP (UINT64_C(1) << 63)
+
+// order() of every byte packed into 8 bits, digits and the end of the
+// string share a rank
+static unsigned char name_rank[256];
+
+static void init_name_rank(void) {
+	bool seen[512 + 2] = {0};
+	for (int c = 1; c < 256; c++)
+		seen[order((char)c) + 1] = true;
+	seen[order('0') + 1] = true;
+	int r = 0, rank[512 + 2];
+	for (int o = 0; o < 512 + 2; o++)
+		rank[o] = seen[o] ? ++r : 0;
+	for (int c = 0; c < 256; c++)
+		name_rank[c] = rank[order((char)c) + 1];
+}
+
+// dotfile bit, then the version prefix in the order verrevcmp compares it:
+// the leading non-digits, then the first number as its count of significant
+// digits and the digits themselves, for as long as 62 bits last
+static uint64_t fi_name_key(const file_info *fi) {
+	const char *s = fi->name;
+	size_t pre = fi->name_suf, i = 0, d = 0;
+	uint64_t k = s[0] != '.';
+	int bits = 1;
+	#define KEY_PUT(v, n) (k = k << (n) | (v), bits += (n))
+	if (s[0] == '.') s++;
+	while (bits + 8 <= 63 && i < pre && !ls_isdigit(s[i]))
+		KEY_PUT(name_rank[(unsigned char)s[i++]], 8);
+	if (bits + 8 + 4 <= 63) {
+		KEY_PUT(name_rank['0'], 8);
+		while (i < pre && s[i] == '0') i++;
+		while (i + d < pre && ls_isdigit(s[i + d])) d++;
+		KEY_PUT(MIN(d, 15), 4);
+		for (size_t j = 0; d < 15 && j < d && bits + 4 <= 63; j++)
+			KEY_PUT(s[i + j] - '0', 4);
+	}
+	#undef KEY_PUT
+	return k << (63 - bits);
+}
+
+static uint64_t fi_key(const file_info *fi) {
+	uint64_t k;
+	if (options.sort == SORT_SIZE)
+		k = fi->size;
+	else if (options.sort == SORT_TIME)
+		k = ((uint64_t)fi->time ^ KEY_GROUP) >> 1;
+	else
+		k = fi_name_key(fi);
+	if (options.reverse) k = ~k & ~KEY_GROUP;
+	if (!options.no_group_dir && !fi_isdir(fi)) k |= KEY_GROUP;
+	return k;
+}
+
+// file info vector, entries live in fixed size chunks that are never moved.
+// A chunk holds the hot halves of its entries in one array and the cold
+// halves in another, and is aligned to FV_CHUNK_ALIGN so that an entry finds
+// its cold half from its address
+#define FV_CHUNK_SHIFT 12
+#define FV_CHUNK (1 << FV_CHUNK_SHIFT)
+#define FV_CHUNK_ALIGN ((uintptr_t)1 << 19)
+
+struct fv_chunk {
+	file_info hot[FV_CHUNK];
+	file_cold cold[FV_CHUNK];
+};
+
+static file_cold *fi_cold(const file_info *fi) {
+	struct fv_chunk *c = (void *)((uintptr_t)fi & ~(FV_CHUNK_ALIGN - 1));
+	return &c->cold[fi - c->hot];
+}
+
 typedef struct {
-	file_info *data;
-	size_t cap, len;
+	struct fv_chunk **chunks;
+	uint32_t *sorted; // indices of the entries in output order, see fv_sort
+	size_t nchunks, len, sorted_cap;
+	struct arena arena; // names and link targets of the entries
+	size_t flushed; // entries already streamed out, see fmt_stream
+	const char *dir; // directory the entries are in, 0 for operands
 	int nwidth, uwidth, gwidth;
 	bool userinfo;
 	id_t uid, gid;
@@ -204,345 +429,2041 @@ typedef struct {
 static void fv_clear(file_list *v) {
 	v->nwidth = v->uwidth = v->gwidth = 0;
 	v->userinfo = options.userinfo == UINFO_ALWAYS;
-	v->len = 0;
+	v->len = v->flushed = 0;
+	v->dir = 0;
+	arena_reset(&v->arena);
 }
 
-static void fv_init(file_list *v, size_t init) {
-	v->data = xmalloc(init, sizeof(file_info));
-	v->cap = init;
+static void fv_init(file_list *v) {
+	*v = (file_list){0};
 	fv_clear(v);
 }
 
-static file_info *fv_index(file_list *v, size_t i) { return &v->data[i]; }
+static void fv_free(file_list *v) {
+	for (size_t i = 0; i < v->nchunks; i++) free(v->chunks[i]);
+	free(v->chunks);
+	free(v->sorted);
+	arena_free(&v->arena);
+}
+
+static file_info *fv_index(file_list *v, size_t i) {
+	return &v->chunks[i >> FV_CHUNK_SHIFT]->hot[i & (FV_CHUNK - 1)];
+}
 
 static file_info *fv_stage(file_list *v) {
-	if (v->len >= v->cap) {
-		v->cap = size_mul(v->cap, 2);
-		v->data = xrealloc(v->data, v->cap, sizeof(file_info));
+	if (v->len >> FV_CHUNK_SHIFT >= v->nchunks) {
+		void *c;
+		assertx(sizeof(struct fv_chunk) <= FV_CHUNK_ALIGN);
+		assertx(v->len < UINT32_MAX); // indices in v->sorted
+		if (posix_memalign(&c, FV_CHUNK_ALIGN, sizeof(struct fv_chunk)))
+			die("%s", "memory exhausted");
+		v->chunks = xrealloc(v->chunks, v->nchunks + 1, sizeof(*v->chunks));
+		v->chunks[v->nchunks++] = c;
 	}
 	return fv_index(v, v->len);
 }
 
 static void fv_commit(file_list *v) { v->len++; }
 
-// read symlink target
-static const char *ls_readlink(int dirfd, const char *name, size_t size) {
-	char *buf = xmalloc(size + 1, 1); // allocate length + \0
-	ssize_t n = readlinkat(dirfd, name, buf, size);
-	if (n == -1) {
-		free(buf);
-		return 0;
-	}
-	assertx((size_t)n == size); // possible truncation
-	buf[n] = '\0';
-	return buf;
+// copy a whole entry, both halves
+static void fv_copy(file_info *dst, const file_info *src) {
+	*dst = *src;
+	*fi_cold(dst) = *fi_cold(src);
 }
 
-// populates file_info with file information
-static int ls_stat(file_list *l, file_info *fi, int dirfd, char *name) {
-	fi->name = name;
-	fi->name_len = strlen(name);
-	fi->name_suf = suf_index(name, fi->name_len);
-	fi->linkname = 0;
-	fi->linkok = true;
-	struct stat st;
-	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
-		return -1;
-	fi->mode = st.st_mode;
-	fi->time = options.m_time ? st.st_mtime : st.st_ctime;
-	fi->size = st.st_size;
-	fi->uid = st.st_uid;
-	fi->gid = st.st_gid;
-	if (options.userinfo == UINFO_AUTO)
-		l->userinfo |= st.st_uid != l->uid || st.st_gid != l->gid;
-	if (S_ISLNK(fi->mode)) {
-		const char *ln = ls_readlink(dirfd, name, st.st_size);
-		if (!ln) { fi->linkok = false; return 0; }
-		fi->linkname = ln;
-		fi->linkname_len = (size_t)st.st_size;
-		if (fstatat(dirfd, name, &st, 0) == -1) {
-			fi->linkok = false;
-			return 0;
+// the list qsort compares indices of, per thread as lists are sorted by the
+// tree pool
+static __thread file_list *sort_list;
+
+static int fi_index_cmp(const void *a, const void *b) {
+	return fi_cmp(fv_index(sort_list, *(const uint32_t *)a),
+		fv_index(sort_list, *(const uint32_t *)b));
+}
+
+struct sort_item { uint64_t key; uint32_t i; };
+
+// lsd radix sort on the keys, skipping the bytes all keys share
+static struct sort_item *radix_sort(struct sort_item *a, struct sort_item *tmp,
+	size_t n)
+{
+	for (int shift = 0; shift < 64; shift += 8) {
+		size_t count[256] = {0};
+		for (size_t i = 0; i < n; i++)
+			count[a[i].key >> shift & 0xff]++;
+		if (count[a[0].key >> shift & 0xff] == n)
+			continue;
+		size_t sum = 0;
+		for (int b = 0; b < 256; b++) {
+			size_t c = count[b];
+			count[b] = sum;
+			sum += c;
 		}
-		fi->linkmode = st.st_mode;
+		for (size_t i = 0; i < n; i++)
+			tmp[count[a[i].key >> shift & 0xff]++] = a[i];
+		struct sort_item *t = a;
+		a = tmp, tmp = t;
 	}
-	return 0;
+	return a;
 }
 
-// list directory
-static int ls_readdir(file_list *v, const char *name) {
-	DIR *dir = opendir(name);
-	if (!dir) {
-		warn_errno("cannot open directory '%s'", name);
-		return -1;
+#define SORT_RADIX_MIN 64 // smaller lists are left to qsort
+
+// order the entries for output, only the indices in v->sorted are moved
+static void fv_sort_raw(file_list *v) {
+	if (!v->len) return;
+	if (v->len > v->sorted_cap) {
+		v->sorted_cap = MAX(v->len, v->sorted_cap * 2);
+		v->sorted = xrealloc(v->sorted, v->sorted_cap, sizeof(*v->sorted));
 	}
-	int fd = dirfd(dir);
-	if (fd == -1) {
-		warn_errno("%s", name);
-		return -1;
+	size_t n = v->len;
+	sort_list = v;
+	if (n < SORT_RADIX_MIN || options.unsorted) {
+		for (size_t i = 0; i < n; i++)
+			v->sorted[i] = i;
+		if (!options.unsorted)
+			qsort(v->sorted, n, sizeof(*v->sorted), fi_index_cmp);
+		return;
 	}
-	struct dirent *dent;
-	int err = 0;
-	while ((dent = readdir(dir))) {
-		const char *p = dent->d_name;
-		if (p[0] == '.' && !options.all) continue;
-		if (p[0] == '.' && p[1] == '\0') continue;
-		if (p[0] == '.' && p[1] == '.' && p[2] == '\0') continue;
-		file_info *out = fv_stage(v);
-		char *dup = strdup(p);
-		if (ls_stat(v, out, fd, dup) == -1) {
-			free(dup);
-			err = -1;
-			warn_errno("cannot access '%s/%s'", name, p);
-			continue;
+	struct sort_item *items = xmalloc(n, 2 * sizeof(*items)), *s;
+	for (size_t i = 0; i < n; i++)
+		items[i] = (struct sort_item){ fi_key(fv_index(v, i)), i };
+	s = radix_sort(items, items + n, n);
+	// entries that share a key are ordered by the full comparison
+	for (size_t i = 0, j; i < n; i = j) {
+		for (j = i; j < n && s[j].key == s[i].key; j++)
+			v->sorted[j] = s[j].i;
+		if (j - i > 1)
+			qsort(v->sorted + i, j - i, sizeof(*v->sorted), fi_index_cmp);
+	}
+	free(items);
+}
+
+static void fv_sort(file_list *v) {
+	uint64_t t = prof_start();
+	fv_sort_raw(v);
+	prof_end(PROF_SORT, t);
+}
+
+static file_info *fv_sorted(file_list *v, size_t i) {
+	return fv_index(v, v->sorted[i]);
+}
+
+// fold a statted entry into the list-wide state
+static void fv_account(file_list *v, const file_info *fi) {
+	const file_cold *fc = fi_cold(fi);
+	if (options.userinfo == UINFO_AUTO)
+		v->userinfo |= fc->uid != v->uid || fc->gid != v->gid;
+}
+
+// metadata the active options need, filled in by stat_plan
+enum stat_need_flags {
+	NEED_MODE_REG = 1 << 0, // permission bits of regular files
+	NEED_MODE_DIR = 1 << 1, // permission bits of directories
+	NEED_MODE     = 1 << 2, // permission bits of everything
+	NEED_SIZE     = 1 << 3,
+	NEED_TIME     = 1 << 4,
+	NEED_OWNER    = 1 << 5,
+	NEED_LINKNAME = 1 << 6, // symlink target
+	NEED_LINKTYPE = 1 << 7, // file type of the symlink target
+	NEED_LINKMODE = 1 << 8, // full mode of the symlink target
+	NEED_INO      = 1 << 9, // inode of entries that are not from a directory
+};
+
+static unsigned stat_need;
+
+#ifndef DTTOIF
+#define DTTOIF(t) ((t) << 12)
+#endif
+
+#ifdef STATX_TYPE
+#define HAVE_STATX 1
+#else
+#define STATX_TYPE   0x0001U
+#define STATX_MODE   0x0002U
+#define STATX_NLINK  0x0004U
+#define STATX_UID    0x0008U
+#define STATX_GID    0x0010U
+#define STATX_MTIME  0x0040U
+#define STATX_CTIME  0x0080U
+#define STATX_INO    0x0100U
+#define STATX_SIZE   0x0200U
+#define STATX_BLOCKS 0x0400U
+#endif
+
+// statx mask for an entry with directory entry type t, 0 if the entry does
+// not need to be looked at
+static unsigned stat_mask(unsigned need, unsigned char t) {
+	unsigned m = 0;
+	if (need & NEED_SIZE) m |= options.du ? STATX_BLOCKS : STATX_SIZE;
+	if (need & NEED_TIME) m |= options.m_time ? STATX_MTIME : STATX_CTIME;
+	if (need & NEED_OWNER) m |= STATX_UID|STATX_GID;
+	if (need & NEED_MODE) m |= STATX_MODE;
+	switch (t) {
+	case DT_UNKNOWN: m |= STATX_MODE; break;
+	case DT_REG: if (need & NEED_MODE_REG) m |= STATX_MODE; break;
+	case DT_DIR: if (need & NEED_MODE_DIR) m |= STATX_MODE; break;
+	}
+	return m ? m|STATX_TYPE : 0;
+}
+
+#ifdef HAVE_STATX
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+	st->st_mode = stx->stx_mode;
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_nlink = stx->stx_nlink;
+	st->st_blocks = stx->stx_blocks;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_size = stx->stx_size;
+	st->st_mtime = stx->stx_mtime.tv_sec;
+	st->st_ctime = stx->stx_ctime.tv_sec;
+}
+
+static bool no_statx; // set once statx returned ENOSYS, read by all threads
+#endif
+
+// stat relative to dirfd, fetching at least the fields in statx mask
+static int ls_statat_raw(int dirfd, const char *name, int flags,
+	unsigned mask, struct stat *st)
+{
+#ifdef HAVE_STATX
+	if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+		struct statx stx;
+		if (statx(dirfd, name, flags, mask, &stx) == 0) {
+			statx_to_stat(&stx, st);
+			return 0;
 		}
-		fv_commit(v);
+		if (errno != ENOSYS) return -1;
+		__atomic_store_n(&no_statx, true, __ATOMIC_RELAXED);
 	}
-	if (closedir(dir) == -1)
-		return -1;
-	return err;
+#else
+	(void)mask;
+#endif
+	return fstatat(dirfd, name, st, flags);
 }
 
-// list file/directory
-static int ls(file_list *v, const char *name) {
-	file_info *out = fv_stage(v); // new uninitialized file_info
-	char *dup = strdup(name);
-	if (ls_stat(v, out, AT_FDCWD, dup) == -1) {
-		free(dup);
-		warn_errno("cannot access '%s'", name);
-		return -1;
+static int ls_statat(int dirfd, const char *name, int flags, unsigned mask,
+	struct stat *st)
+{
+	uint64_t t = prof_start();
+	prof_count(PROF_STATS, 1);
+	int r = ls_statat_raw(dirfd, name, flags, mask, st);
+	prof_end(PROF_STAT, t);
+	return r;
+}
+
+// read symlink target
+static const char *ls_readlink(struct arena *a, int dirfd, const char *name,
+	int *len)
+{
+	char buf[PATH_MAX];
+	uint64_t t = prof_start();
+	prof_count(PROF_READLINKS, 1);
+	ssize_t n = readlinkat(dirfd, name, buf, sizeof(buf));
+	prof_end(PROF_READLINK, t);
+	if (n == -1) return 0;
+	assertx((size_t)n < sizeof(buf)); // possible truncation
+	*len = n;
+	return arena_strndup(a, buf, n);
+}
+
+// resets fi before it is looked at, returns the statx mask it still needs
+static unsigned ls_stat_begin(file_info *fi, unsigned need) {
+	file_cold *fc = fi_cold(fi);
+	fi->name_len = strlen(fi->name);
+	fi->name_suf = suf_index(fi->name, fi->name_len);
+	fc->linkname = 0;
+	fc->linkok = true;
+	fi->mode = DTTOIF(fc->type);
+	fi->linkmode = 0;
+	fi->time = 0;
+	fi->size = 0;
+	fc->uid = fc->gid = 0;
+	unsigned mask = stat_mask(need, fc->type);
+	// operands and --files-from paths have no directory entry to take it from
+	if (need & NEED_INO && !fc->ino) mask |= STATX_TYPE|STATX_INO;
+	return mask;
+}
+
+static void ls_stat_fill(file_info *fi, const struct stat *st) {
+	file_cold *fc = fi_cold(fi);
+	fi->mode = st->st_mode;
+	fi->time = options.m_time ? st->st_mtime : st->st_ctime;
+	fi->size = options.du ? (off_t)st->st_blocks * 512 : st->st_size;
+	fc->uid = st->st_uid;
+	fc->gid = st->st_gid;
+	if (!fc->ino) fc->ino = st->st_ino;
+}
+
+// reads the target of a symlink into a, returns whether the target has to be
+// statted
+static bool ls_stat_link(file_info *fi, struct arena *a, int dirfd,
+	unsigned need)
+{
+	if (!S_ISLNK(fi->mode)) return false;
+	if (need & NEED_LINKNAME) {
+		file_cold *fc = fi_cold(fi);
+		const char *ln = ls_readlink(a, dirfd, fi->name, &fc->linkname_len);
+		if (!ln) { fc->linkok = false; return false; }
+		fc->linkname = ln;
 	}
-	if (!options.dir && fi_isdir(out)) {
-		free(dup);
-		return ls_readdir(v, name);
+	return need & (NEED_LINKTYPE|NEED_LINKMODE);
+}
+
+// populates file_info with the information in need, fi->name and its type
+// have to be set; safe to call from several threads with separate arenas
+static int ls_stat(file_info *fi, struct arena *a, int dirfd, unsigned need) {
+	struct stat st;
+	unsigned mask = ls_stat_begin(fi, need);
+	if (mask) {
+		if (ls_statat(dirfd, fi->name, AT_SYMLINK_NOFOLLOW, mask, &st) == -1)
+			return -1;
+		ls_stat_fill(fi, &st);
 	}
-	fv_commit(v);
+	if (!ls_stat_link(fi, a, dirfd, need))
+		return 0;
+	if (ls_statat(dirfd, fi->name, 0, STATX_TYPE|STATX_MODE, &st) == -1)
+		fi_cold(fi)->linkok = false;
+	else
+		fi->linkmode = st.st_mode;
 	return 0;
 }
 
-enum ls_color_labels {
-	L_LEFT, L_RIGHT, L_END, L_RESET, L_NORM, L_FILE, L_DIR, L_LINK, L_FIFO,
-	L_SOCK, L_BLK, L_CHR, L_MISSING, L_ORPHAN, L_EXEC, L_DOOR, L_SETUID,
-	L_SETGID, L_STICKY, L_OW, L_STICKYOW, L_CAP, L_MULTIHARDLINK, L_CLR_TO_EOL,
-	L_LENGTH,
+// directory entry as returned by ld_next, name is valid until the next call
+struct ls_dirent {
+	const char *name;
+	ino_t ino;
+	unsigned char type;
 };
 
-struct lsc_pair {
-	const char *ext;
-	const char *color;
+// directory stream, parses getdents64 records in place where available and
+// falls back to readdir otherwise
+struct ls_dir {
+	int fd;
+	DIR *dir;
+	size_t len, pos;
 };
 
-struct {
-	char *labels[L_LENGTH];
-	struct lsc_pair *map;
-	size_t exts;
-} ls_colors;
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#endif
 
-static const char *const lsc_labels[] = {
-	"lc", "rc", "ec", "rs", "no", "fi", "di", "ln",
-	"pi", "so", "bd", "cd", "mi", "or", "ex", "do",
-	"su", "sg", "st", "ow", "tw", "ca", "mh", "cl", NULL,
+#ifdef SYS_getdents64
+struct ls_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
 };
 
-static int lsc_cmp(const void *va, const void *vb) {
-	struct lsc_pair *a = (struct lsc_pair *const)va;
-	struct lsc_pair *b = (struct lsc_pair *const)vb;
-	return strcmp(a->ext, b->ext);
+// shared by the directory streams of a thread, they are read one at a time
+static __thread char *dirbuf;
+#define DIRBUF_SIZE (256 * 1024)
+#endif
+
+// open name relative to dirfd
+static int ld_open_raw(struct ls_dir *d, int dirfd, const char *name) {
+	d->len = d->pos = 0;
+	d->dir = 0;
+	d->fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (d->fd == -1) return -1;
+#ifdef SYS_getdents64
+	if (!dirbuf) dirbuf = xmalloc(DIRBUF_SIZE, 1);
+	return 0;
+#else
+	d->dir = fdopendir(d->fd);
+	if (d->dir) return 0;
+	close(d->fd);
+	return -1;
+#endif
 }
 
-static const char *lsc_lookup(const char *ext) {
-	struct lsc_pair k = { .ext = ext, .color = NULL }, *res;
-	res = bsearch(&k, ls_colors.map, ls_colors.exts, sizeof(k), lsc_cmp);
-	return res ? res->color : NULL;
+static int ld_open(struct ls_dir *d, int dirfd, const char *name) {
+	uint64_t t = prof_start();
+	int r = ld_open_raw(d, dirfd, name);
+	prof_end(PROF_READ, t);
+	return r;
 }
 
-static void lsc_parse(char *lsc_env) {
-	size_t exts = 0, exti = 0;
-	size_t len = strlen(lsc_env);
-	for (size_t i = 0; i < len; i++) if (lsc_env[i] == '*') exts++;
-	ls_colors.map = xmalloc(exts, sizeof(*ls_colors.map));
-	bool eq = false;
-	size_t kbegin = 0, kend = 0;
-	for (size_t i = 0; i < len; i++) {
-		char c = lsc_env[i];
-		if (c == '=') { kend = i; eq = true; continue; }
-		if (!eq || c != ':') continue;
-		lsc_env[kend] = lsc_env[i] = '\0';
-		char *k = lsc_env + kbegin;
-		char *v = lsc_env + kend + 1;
-		if (*k == '*')
-			ls_colors.map[exti++] = (struct lsc_pair) { k + 1, v };
-		else if (kend - kbegin == 2)
-			for (size_t i = 0; i < L_LENGTH; i++)
-				if (k[0] == lsc_labels[i][0] && k[1] == lsc_labels[i][1]) {
-					ls_colors.labels[i] = v;
-					break;
-				}
-		kbegin = i + 1;
-		i += 2;
-		eq = false;
+// returns 1 and fills e on success, 0 at the end of the directory, -1 on error
+static int ld_next(struct ls_dir *d, struct ls_dirent *e) {
+#ifdef SYS_getdents64
+	if (!d->dir) {
+		if (d->pos >= d->len) {
+			uint64_t t = prof_start();
+			long n = syscall(SYS_getdents64, d->fd, dirbuf, DIRBUF_SIZE);
+			prof_end(PROF_READ, t);
+			if (n == -1 && errno == ENOSYS) {
+				d->dir = fdopendir(d->fd);
+				if (!d->dir) return -1;
+				return ld_next(d, e);
+			}
+			if (n <= 0) return n;
+			d->len = n;
+			d->pos = 0;
+		}
+		struct ls_dirent64 *de = (struct ls_dirent64 *)(dirbuf + d->pos);
+		d->pos += de->d_reclen;
+		e->name = de->d_name;
+		e->ino = de->d_ino;
+		e->type = de->d_type;
+		return 1;
 	}
-	ls_colors.exts = exti;
-	qsort(ls_colors.map, ls_colors.exts, sizeof(*ls_colors.map), lsc_cmp);
+#endif
+	errno = 0;
+	uint64_t t = prof_start();
+	struct dirent *de = readdir(d->dir);
+	prof_end(PROF_READ, t);
+	if (!de) return errno ? -1 : 0;
+	e->name = de->d_name;
+	e->ino = de->d_ino;
+#ifdef _DIRENT_HAVE_D_TYPE
+	e->type = de->d_type;
+#else
+	e->type = DT_UNKNOWN;
+#endif
+	return 1;
 }
 
-struct idcache { struct idcache *next; id_t id; char name[]; };
+static int ld_close(struct ls_dir *d) {
+	return d->dir ? closedir(d->dir) : close(d->fd);
+}
 
-static const char *id_put(struct idcache **cache, id_t id, const char *name) {
-	struct idcache *p = xmalloc(sizeof(*p) + strlen(name) + 1, 1);
-	strcpy(p->name, name);
-	p->id = id;
-	p->next = *cache, *cache = p;
-	return p->name[0] ? p->name : 0;
+// release the buffer of the calling thread
+static void ld_exit(void) {
+#ifdef SYS_getdents64
+	free(dirbuf);
+	dirbuf = 0;
+#endif
 }
 
-static struct idcache *ucache;
+// parallel stat: entries are claimed STAT_CHUNK at a time by the workers
+#define STAT_CHUNK 64
+#define STAT_PARALLEL_MIN 1024 // smaller directories are statted serially
+#define STAT_THREADS_MAX 64
 
-static const char *getuser(uid_t id) {
-	for (struct idcache *p = ucache; p; p = p->next)
-		if (p->id == id) return p->name[0] ? p->name : 0;
-	struct passwd *e = getpwuid(id);
-	return id_put(&ucache, id, e ? e->pw_name : "");
-}
+struct stat_job {
+	file_list *v;
+	size_t begin, next, end;
+	int dirfd;
+	unsigned need;
+	int *errs; // errno of each entry in [begin, end), 0 on success
+};
 
-static struct idcache *gcache;
+struct stat_thread {
+	struct stat_job *job;
+	struct arena arena; // link targets, adopted by the list after the join
+};
 
-static const char *getgroup(gid_t id) {
-	for (struct idcache *p = gcache; p; p = p->next)
-		if (p->id == id) return p->name[0] ? p->name : 0;
-	struct group *e = getgrgid(id);
-	return id_put(&ucache, id, e ? e->gr_name : "");
+static void *stat_worker(void *p) {
+	struct stat_thread *t = p;
+	struct stat_job *j = t->job;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&j->next, STAT_CHUNK, __ATOMIC_RELAXED);
+		if (i >= j->end) break;
+		for (size_t e = MIN(i + STAT_CHUNK, j->end); i < e; i++) {
+			file_info *fi = fv_index(j->v, i);
+			int r = ls_stat(fi, &t->arena, j->dirfd, j->need);
+			j->errs[i - j->begin] = r ? errno : 0;
+		}
+	}
+	return 0;
 }
 
-static void fmt_strmode(FILE *out, const mode_t mode) {
-	switch (mode&S_IFMT) {
-	case S_IFREG:  fputs(C_FILE,    out); break;
-	case S_IFDIR:  fputs(C_DIR,     out); break;
-	case S_IFCHR:  fputs(C_CHAR,    out); break;
-	case S_IFBLK:  fputs(C_BLOCK,   out); break;
-	case S_IFIFO:  fputs(C_FIFO,    out); break;
-	case S_IFLNK:  fputs(C_LINK,    out); break;
-	case S_IFSOCK: fputs(C_SOCK,    out); break;
-	default:       fputs(C_UNKNOWN, out); break;
-	}
-	fputs(mode&S_IRUSR ? C_READ : C_NONE, out);
-	fputs(mode&S_IWUSR ? C_WRITE : C_NONE, out);
-	fputs(mode&S_ISUID ? mode&S_IXUSR ? C_UID_EXEC : C_UID
-	                   : mode&S_IXUSR ? C_EXEC : C_NONE, out);
-	fputs(mode&S_IRGRP ? C_READ : C_NONE, out);
-	fputs(mode&S_IWGRP ? C_WRITE : C_NONE, out);
-	fputs(mode&S_ISGID ? mode&S_IXGRP ? C_UID_EXEC : C_UID
-	                   : mode&S_IXGRP ? C_EXEC : C_NONE, out);
-	fputs(mode&S_IROTH ? C_READ : C_NONE, out);
-	fputs(mode&S_IWOTH ? C_WRITE : C_NONE, out);
-	fputs(mode&S_ISVTX ? mode&S_IXOTH ? C_STICKY : C_STICKY_O
-	                   : mode&S_IXOTH ? C_EXEC : C_NONE, out);
-	fputs("\033[38;5;235m ▏\033[0m",out);
-}
+#if defined(IO_URING_OP_SUPPORTED) && defined(HAVE_STATX) && defined(SYS_io_uring_setup)
+#define HAVE_URING 1
 
-#define SECOND 1
-#define MINUTE (60 * SECOND)
-#define HOUR   (60 * MINUTE)
-#define DAY    (24 * HOUR)
-#define WEEK   (7  * DAY)
-#define MONTH  (30 * DAY)
-#define YEAR   (12 * MONTH)
+// io_uring backend for the metadata phase, submits statx for a batch of
+// entries at once and reaps the completions into file_info
+#define URING_ENTRIES 256
 
-time_t now;
+static struct uring {
+	int fd;
+	unsigned tail;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct statx *bufs;   // result buffer of each submission slot
+	size_t *slots;        // entry index of each submission slot
+	struct io_uring_cqe *done;
+} ring;
+static int ring_state; // 0 untried, 1 usable, -1 unavailable
 
-static void get_current_time(void) {
-	struct timespec t;
-	if (clock_gettime(CLOCK_REALTIME, &t) == -1)
-		die_errno("%s", "current_time");
-	now = t.tv_sec;
+static bool uring_probe(int fd) {
+	size_t n = IORING_OP_STATX + 1;
+	struct io_uring_probe *p = calloc(1, sizeof(*p) + n * sizeof(p->ops[0]));
+	assertx(p);
+	bool ok = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, p, n) == 0
+		&& p->last_op >= IORING_OP_STATX
+		&& p->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED;
+	free(p);
+	return ok;
 }
 
-static void fmt_abstime(FILE *out, const time_t then) {
-	time_t diff = now - then;
-	char buf[20];
-	struct tm tm;
-	localtime_r(&then, &tm);
-	char *fmt = diff < MONTH * 6 ? "%e %b %H:%M" : "%e %b  %Y";
-	strftime(buf, sizeof(buf), fmt, &tm);
-	fputs(C_DAY, out);
-	fputs(buf, out);
-	fputs("\033[38;5;235m ▏\033[0m",out);
+static void *uring_map(int fd, size_t size, off_t off) {
+	void *p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		fd, off);
+	return p == MAP_FAILED ? 0 : p;
 }
 
-static void fmt3(char b[static 3], int x) {
-	if (x/100) b[0] = '0' + x/100;
-	if (x/100||x/10%10) b[1] = '0' + x/10%10;
-	b[2] = '0' + x%10;
+// set the ring up on first use, fails where io_uring is missing or filtered
+static bool uring_init(struct uring *r) {
+	if (ring_state) return ring_state > 0;
+	ring_state = -1;
+	struct io_uring_params p = {0};
+	int fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+	if (fd == -1) return false;
+	if (!uring_probe(fd)) { close(fd); return false; }
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) sq_size = cq_size = MAX(sq_size, cq_size);
+	char *sq = uring_map(fd, sq_size, IORING_OFF_SQ_RING);
+	char *cq = single ? sq : uring_map(fd, cq_size, IORING_OFF_CQ_RING);
+	r->sqes = uring_map(fd, p.sq_entries * sizeof(*r->sqes), IORING_OFF_SQES);
+	if (!sq || !cq || !r->sqes) { close(fd); return false; }
+	r->fd = fd;
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->tail = *r->sq_tail;
+	r->bufs = xmalloc(URING_ENTRIES, sizeof(*r->bufs));
+	r->slots = xmalloc(URING_ENTRIES, sizeof(*r->slots));
+	r->done = xmalloc(URING_ENTRIES, sizeof(*r->done));
+	ring_state = 1;
+	return true;
 }
 
-static void fmt_reltime(FILE *out, const time_t then) {
-	time_t diff = now - then;
-	if (diff < 0) {
-		fputs(C_SECOND " 0s " C_END, out);
-		fputs("\033[38;5;235m ▏\033[0m",out);
-		return;
+static void uring_statx(struct uring *r, unsigned slot, size_t i, int dirfd,
+	const char *name, int flags, unsigned mask)
+{
+	unsigned idx = r->tail++ & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)name;
+	sqe->len = mask;
+	sqe->off = (uintptr_t)&r->bufs[slot];
+	sqe->statx_flags = flags;
+	sqe->user_data = slot;
+	r->sq_array[idx] = idx;
+	r->slots[slot] = i;
+}
+
+// submit n queued statx calls and wait for all of them to complete
+static int uring_run_raw(struct uring *r, unsigned n) {
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	unsigned todo = n, reaped = 0;
+	while (todo) {
+		long ret = syscall(SYS_io_uring_enter, r->fd, todo, 0, 0, 0, 0);
+		if (ret == -1 && errno != EINTR && errno != EAGAIN) return -1;
+		if (ret > 0) todo -= ret;
 	}
-	if (diff <= SECOND) {
-		fputs(C_SECOND "<1s " C_END, out);
-		fputs("\033[38;5;235m ▏\033[0m",out);
-		return;
+	while (reaped < n) {
+		unsigned head = *r->cq_head;
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			long ret = syscall(SYS_io_uring_enter, r->fd, 0, 1,
+				IORING_ENTER_GETEVENTS, 0, 0);
+			if (ret == -1 && errno != EINTR) return -1;
+			continue;
+		}
+		r->done[reaped++] = r->cqes[head & *r->cq_mask];
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
 	}
-	char b[4] = "  0s";
-	if (diff < MINUTE) {
-		fputs(C_SECOND, out);
-	} else if (diff < HOUR) {
-		fputs(C_MINUTE, out);
-		diff /= MINUTE;
-		b[3] = 'm';
-	} else if (diff < HOUR*36) {
-		fputs(C_HOUR, out);
-		diff /= HOUR;
-		b[3] = 'h';
-	} else if (diff < MONTH) {
-		fputs(C_DAY, out);
-		diff /= DAY;
-		b[3] = 'd';
-	} else if (diff < YEAR) {
-		fputs(C_WEEK, out);
-		diff /= WEEK;
-		b[3] = 'w';
-	} else {
-		fputs(C_YEAR, out);
-		diff /= YEAR;
-		b[3] = 'y';
+	return 0;
+}
+
+static int uring_run(struct uring *r, unsigned n) {
+	uint64_t t = prof_start();
+	int ret = uring_run_raw(r, n);
+	prof_count(PROF_STATS, n);
+	prof_end(PROF_STAT, t);
+	return ret;
+}
+
+// stat the job through the ring, returns -1 once the ring fails, leaving the
+// remaining entries from j->next on to the other backends
+static int uring_stat_all(struct stat_job *j) {
+	struct uring *r = &ring;
+	if (!uring_init(r)) return -1;
+	struct stat st;
+	while (j->next < j->end) {
+		size_t lo = j->next, hi = MIN(lo + URING_ENTRIES, j->end);
+		unsigned n = 0;
+		for (size_t i = lo; i < hi; i++) {
+			file_info *fi = fv_index(j->v, i);
+			unsigned mask = ls_stat_begin(fi, j->need);
+			j->errs[i - j->begin] = 0;
+			if (mask)
+				uring_statx(r, n++, i, j->dirfd, fi->name,
+					AT_SYMLINK_NOFOLLOW, mask);
+		}
+		if (uring_run(r, n) == -1) goto fail;
+		for (unsigned k = 0; k < n; k++) {
+			unsigned slot = r->done[k].user_data;
+			size_t i = r->slots[slot];
+			if (r->done[k].res < 0) {
+				j->errs[i - j->begin] = -r->done[k].res;
+				continue;
+			}
+			statx_to_stat(&r->bufs[slot], &st);
+			ls_stat_fill(fv_index(j->v, i), &st);
+		}
+		// follow the symlinks in the batch
+		n = 0;
+		for (size_t i = lo; i < hi; i++) {
+			file_info *fi = fv_index(j->v, i);
+			if (!j->errs[i - j->begin] &&
+			    ls_stat_link(fi, &j->v->arena, j->dirfd, j->need))
+				uring_statx(r, n++, i, j->dirfd, fi->name, 0,
+					STATX_TYPE|STATX_MODE);
+		}
+		if (uring_run(r, n) == -1) goto fail;
+		for (unsigned k = 0; k < n; k++) {
+			unsigned slot = r->done[k].user_data;
+			file_info *fi = fv_index(j->v, r->slots[slot]);
+			if (r->done[k].res < 0)
+				fi_cold(fi)->linkok = false;
+			else
+				fi->linkmode = r->bufs[slot].stx_mode;
+		}
+		j->next = hi;
 	}
-	fmt3(b, diff);
-	fwrite(b+1, 1, 3, out);
-	putc(' ', out);
-	fputs("\033[38;5;235m ▏\033[0m",out);
+	return 0;
+fail:
+	// completions may still be in flight, never touch the ring again
+	ring_state = -1;
+	return -1;
 }
+#endif
 
-static const char *const C_SIZES[7] = { "B", "K", "M", "G", "T", "P", "E" };
+static int stat_threads(size_t n) {
+	if (options.jobs) return options.jobs;
+	if (n < STAT_PARALLEL_MIN) return 1;
+	// the calls mostly wait on the filesystem, so oversubscribe the cpus
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t t = MIN((size_t)MAX(cpus, 1) * 4, n / STAT_PARALLEL_MIN * 4);
+	return MIN(t, STAT_THREADS_MAX);
+}
 
-static off_t divide(off_t x, off_t d) { return (x+(d-1)/2)/d; }
+// -S: sizes are allocated blocks, and those of directories include everything
+// below them. The subtrees of the listed directories are walked by a pool of
+// threads taking directories from a shared stack; a directory adds its blocks
+// to its parent once it and its subdirectories are done. Every directory is
+// walked once per run: one reached again, by -R, by operands that overlap or
+// through a bind mount, adds the blocks of the earlier walk once it is done.
+// Files with several links are left out of the blocks and kept in the
+// directory they were found in; once the walks are joined they are counted
+// once per listing, in the first directory in name order that has them, as du
+// counts them in its first operand. So the sizes do not depend on the order
+// the walks get anywhere, unless bind mounts show a directory with other
+// contents elsewhere or make a loop; the walk that finds a loop leaves the
+// directory out and warns
+struct du_link { uint64_t dev, ino, bytes; };
 
-// TODO: make this reusable
-static void fmt_size(FILE *out, off_t sz) {
-	fputs(C_SIZE, out);
-	int m = 0;
-	off_t div = 1, u = sz;
-	while (u > 999) {
-		div *= 1024;
-		u = divide(u, 1024);
-		m++;
-	}
-	off_t v = divide(sz*10, div);
-	char b[3] = "  0";
-	if (v/10 >= 10 || m == 0) {
-		fmt3(b, u);
-	} else if (sz != 0) {
-		b[0] = '0' + v/10;
-		b[1] = '.';
-		b[2] = '0' + v%10;
-	}
-	fwrite(b, 1, 3, out);
-	fputs(C_SIZES[m], out);
-	putc(' ', out);
+// set of files, open addressing with mask + 1 slots
+struct du_links {
+	struct du_link *t;
+	size_t mask, len;
+};
+
+// a directory reached by a walk that is not its parent
+struct du_reach { struct du_dir *dir; struct du_reach *next; };
+
+struct du_dir {
+	struct du_dir *parent; // 0 for the listed ones
+	int pfd; // the listed ones are opened relative to it
+	const char *name; // relative to parent or pfd
+	struct ls_dir dir;
+	int opens; // kids that still have to open themselves, +1 while reading
+	struct du_link *files; // with several links, in this directory
+	size_t nfiles, files_cap;
+	// the rest is under du.lock until done is set
+	int pending; // kids and reached directories not done, +1 while reading
+	uint64_t bytes; // everything below but the files
+	bool links; // there are files below
+	bool done;
+	unsigned mark; // of du_needs
+	struct du_reach *waiters; // walks that reached it before it was done
+	// kids and reached directories with files below, for du_count
+	struct du_dir *kids, *sib;
+	struct du_reach *reached;
+	struct du_dir *next; // in du.stack
+	char buf[]; // name of kids
+};
+
+struct du_ino { uint64_t dev, ino; struct du_dir *dir; };
+
+#define DU_SEEN_MIN 1024
+#define DU_LINKS_MIN 16
+#define DU_MASK (STATX_TYPE|STATX_NLINK|STATX_INO|STATX_BLOCKS)
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct du_dir *stack;
+	struct du_ino *seen; // directories, open addressing, mask + 1 slots
+	size_t mask, len;
+	unsigned mark;
+	bool started;
+} du = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t du_hash(uint64_t dev, uint64_t ino) {
+	return ((ino ^ dev << 40) * UINT64_C(0x9e3779b97f4a7c15)) >> 16;
+}
+
+static struct du_ino *du_slot(uint64_t dev, uint64_t ino) {
+	size_t i = du_hash(dev, ino) & du.mask;
+	while ((du.seen[i].ino || du.seen[i].dev) &&
+	    (du.seen[i].ino != ino || du.seen[i].dev != dev))
+		i = (i + 1) & du.mask;
+	return &du.seen[i];
+}
+
+// entry of the directory dev and ino, seen tells whether it was there
+// before; du.lock has to be held
+static struct du_ino *du_claim(uint64_t dev, uint64_t ino, bool *seen) {
+	if (2 * (du.len + 1) > du.mask + 1) {
+		struct du_ino *old = du.seen;
+		size_t slots = du.seen ? du.mask + 1 : 0;
+		size_t n = MAX(DU_SEEN_MIN, 2 * slots);
+		du.seen = calloc(n, sizeof(*du.seen));
+		assertx(du.seen);
+		du.mask = n - 1;
+		for (size_t i = 0; i < slots; i++)
+			if (old[i].ino || old[i].dev)
+				*du_slot(old[i].dev, old[i].ino) = old[i];
+		free(old);
+	}
+	struct du_ino *e = du_slot(dev, ino);
+	*seen = e->ino || e->dev;
+	if (!*seen) {
+		*e = (struct du_ino){ dev, ino, 0 };
+		du.len++;
+	}
+	return e;
+}
+
+static struct du_link *du_link_slot(struct du_link *t, size_t mask,
+	uint64_t dev, uint64_t ino)
+{
+	size_t i = du_hash(dev, ino) & mask;
+	while ((t[i].ino || t[i].dev) && (t[i].ino != ino || t[i].dev != dev))
+		i = (i + 1) & mask;
+	return &t[i];
+}
+
+// add a file to l, returns false if it was there
+static bool du_link(struct du_links *l, const struct du_link *f) {
+	if (!l->t || 2 * (l->len + 1) > l->mask + 1) {
+		size_t slots = l->t ? l->mask + 1 : 0;
+		size_t n = MAX(DU_LINKS_MIN, 2 * slots);
+		struct du_link *t = calloc(n, sizeof(*t));
+		assertx(t);
+		for (size_t i = 0; i < slots; i++)
+			if (l->t[i].ino || l->t[i].dev)
+				*du_link_slot(t, n - 1, l->t[i].dev, l->t[i].ino) = l->t[i];
+		free(l->t);
+		l->t = t;
+		l->mask = n - 1;
+	}
+	struct du_link *e = du_link_slot(l->t, l->mask, f->dev, f->ino);
+	if (e->ino || e->dev) return false;
+	*e = *f;
+	l->len++;
+	return true;
+}
+
+// path of d in buf, cut short if it does not fit
+static size_t du_path(char *buf, size_t size, const struct du_dir *d) {
+	size_t n = d->parent ? du_path(buf, size, d->parent) : 0;
+	int r = snprintf(buf + n, size - n, "%s%s", d->parent ? "/" : "", d->name);
+	return r < 0 ? n : MIN(n + r, size - 1);
+}
+
+static void du_warn(const struct du_dir *d) {
+	int e = errno;
+	char path[PATH_MAX];
+	du_path(path, sizeof(path), d);
+	errno = e;
+	warn_errno("cannot read directory '%s'", path);
+}
+
+// du.lock has to be held
+static void du_push(struct du_dir *d) {
+	d->next = du.stack;
+	du.stack = d;
+	pthread_cond_signal(&du.work);
+}
+
+static void du_release(struct du_dir *d) {
+	if (!__atomic_sub_fetch(&d->opens, 1, __ATOMIC_ACQ_REL))
+		ld_close(&d->dir);
+}
+
+// add the directory x, which is done, to d through r; du.lock has to be held
+static void du_reached(struct du_dir *d, struct du_reach *r, struct du_dir *x) {
+	d->bytes += x->bytes;
+	if (!x->links) {
+		free(r);
+		return;
+	}
+	*r = (struct du_reach){ x, d->reached };
+	d->reached = r;
+	d->links = true;
+}
+
+// drop a pending reference to d; once it is done its blocks go to its parent
+// and to the walks waiting on it. du.lock has to be held
+static void du_finish(struct du_dir *d) {
+	if (--d->pending) return;
+	d->done = true;
+	pthread_cond_broadcast(&du.done);
+	while (d->waiters) {
+		struct du_reach *w = d->waiters;
+		struct du_dir *y = w->dir;
+		d->waiters = w->next;
+		du_reached(y, w, d);
+		du_finish(y);
+	}
+	struct du_dir *p = d->parent;
+	if (!p) return;
+	p->bytes += d->bytes;
+	if (d->links) {
+		d->sib = p->kids;
+		p->kids = d;
+		p->links = true;
+	}
+	du_finish(p);
+}
+
+// whether x cannot be done before d, through the parents of d and the walks
+// waiting on them; du.lock has to be held
+static bool du_needs(const struct du_dir *x, struct du_dir *d, unsigned mark) {
+	for (; d && d->mark != mark; d = d->parent) {
+		if (d == x) return true;
+		d->mark = mark;
+		for (struct du_reach *w = d->waiters; w; w = w->next)
+			if (du_needs(x, w->dir, mark)) return true;
+	}
+	return false;
+}
+
+// the subdirectory name of d with stat st: walked if it is new, otherwise its
+// blocks are added once they are known. du.lock has to be held
+static void du_kid(struct du_dir *d, const char *name, const struct stat *st) {
+	bool seen;
+	struct du_ino *s = du_claim(st->st_dev, st->st_ino, &seen);
+	if (!seen) {
+		size_t len = strlen(name);
+		struct du_dir *k = xmalloc(sizeof(*k) + len + 1, 1);
+		*k = (struct du_dir){
+			.parent = d, .name = k->buf, .opens = 1, .pending = 1,
+			.bytes = (uint64_t)st->st_blocks * 512,
+		};
+		memcpy(k->buf, name, len + 1);
+		s->dir = k;
+		__atomic_add_fetch(&d->opens, 1, __ATOMIC_RELAXED);
+		d->pending++;
+		du_push(k);
+		return;
+	}
+	struct du_dir *x = s->dir;
+	struct du_reach *r = xmalloc(1, sizeof(*r));
+	if (x->done) {
+		du_reached(d, r, x);
+		return;
+	}
+	// a loop through bind mounts, directly or through other walks
+	if (du_needs(x, d, ++du.mark)) {
+		char path[PATH_MAX];
+		du_path(path, sizeof(path), d);
+		warn("directory cycle at '%s/%s', not counted", path, name);
+		free(r);
+		return;
+	}
+	*r = (struct du_reach){ d, x->waiters };
+	x->waiters = r;
+	d->pending++;
+}
+
+static void du_read(struct du_dir *d) {
+	int r = ld_open(&d->dir, d->parent ? d->parent->dir.fd : d->pfd, d->name);
+	if (r == -1) du_warn(d);
+	if (d->parent) du_release(d->parent);
+	if (r == -1) {
+		d->opens = 0;
+		pthread_mutex_lock(&du.lock);
+		du_finish(d);
+		pthread_mutex_unlock(&du.lock);
+		return;
+	}
+	uint64_t bytes = 0;
+	struct ls_dirent e;
+	struct stat st;
+	while ((r = ld_next(&d->dir, &e)) == 1) {
+		const char *p = e.name;
+		if (p[0] == '.' && (!p[1] || (p[1] == '.' && !p[2]))) continue;
+		if (ls_statat(d->dir.fd, p, AT_SYMLINK_NOFOLLOW, DU_MASK, &st) == -1)
+			continue;
+		uint64_t b = (uint64_t)st.st_blocks * 512;
+		if (S_ISDIR(st.st_mode)) {
+			pthread_mutex_lock(&du.lock);
+			du_kid(d, p, &st);
+			pthread_mutex_unlock(&du.lock);
+		} else if (st.st_nlink < 2) {
+			bytes += b;
+		} else {
+			if (d->nfiles == d->files_cap) {
+				d->files_cap = MAX(8, 2 * d->files_cap);
+				d->files = xrealloc(d->files, d->files_cap, sizeof(*d->files));
+			}
+			d->files[d->nfiles++] = (struct du_link){ st.st_dev, st.st_ino, b };
+		}
+	}
+	if (r == -1) du_warn(d);
+	du_release(d);
+	pthread_mutex_lock(&du.lock);
+	d->bytes += bytes;
+	if (d->nfiles) d->links = true;
+	du_finish(d);
+	pthread_mutex_unlock(&du.lock);
+}
+
+static void *du_worker(void *p) {
+	(void)p;
+	for (;;) {
+		pthread_mutex_lock(&du.lock);
+		while (!du.stack) pthread_cond_wait(&du.work, &du.lock);
+		struct du_dir *d = du.stack;
+		du.stack = d->next;
+		pthread_mutex_unlock(&du.lock);
+		du_read(d);
+	}
+	return 0;
+}
+
+// the listed directory name in dirfd with stat st, walked unless it was
+// before; du.lock has to be held
+static struct du_dir *du_start(int dirfd, const char *name,
+	const struct stat *st)
+{
+	bool seen;
+	struct du_ino *s = du_claim(st->st_dev, st->st_ino, &seen);
+	if (seen) return s->dir;
+	struct du_dir *d = xmalloc(1, sizeof(*d));
+	*d = (struct du_dir){
+		.pfd = dirfd, .name = name, .opens = 1, .pending = 1,
+		.bytes = (uint64_t)st->st_blocks * 512,
+	};
+	s->dir = d;
+	du_push(d);
+	if (du.started) return d;
+	// the walkers stay for the rest of the run
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = options.jobs ? options.jobs :
+		MIN(MAX(cpus, 1) * 4, STAT_THREADS_MAX);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < n; i++) {
+		pthread_t tid;
+		if (pthread_create(&tid, &attr, du_worker, 0)) {
+			if (!i) die_errno("%s", "cannot create threads");
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	du.started = true;
+	return d;
+}
+
+// blocks of the files below d, which is done, that are not in counted yet
+static uint64_t du_count(struct du_links *counted, const struct du_dir *d) {
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < d->nfiles; i++)
+		if (du_link(counted, &d->files[i])) bytes += d->files[i].bytes;
+	for (const struct du_dir *k = d->kids; k; k = k->sib)
+		bytes += du_count(counted, k);
+	for (const struct du_reach *r = d->reached; r; r = r->next)
+		bytes += du_count(counted, r->dir);
+	return bytes;
+}
+
+struct du_entry { file_info *fi; struct du_dir *dir; };
+
+static int du_entry_cmp(const void *va, const void *vb) {
+	const file_info *a = ((const struct du_entry *)va)->fi;
+	const file_info *b = ((const struct du_entry *)vb)->fi;
+	return filevercmp(a->name, a->name_len, a->name_suf,
+		b->name, b->name_len, b->name_suf);
+}
+
+// replace the sizes of the directories in [begin, v->len) with their totals
+static void du_sizes(file_list *v, size_t begin, int dirfd) {
+	size_t n = 0;
+	struct du_entry *ds = xmalloc(v->len - begin, sizeof(*ds));
+	struct stat st;
+	for (size_t i = begin; i < v->len; i++) {
+		file_info *fi = fv_index(v, i);
+		if (!S_ISDIR(fi->mode) ||
+		    ls_statat(dirfd, fi->name, AT_SYMLINK_NOFOLLOW, DU_MASK, &st) == -1)
+			continue;
+		pthread_mutex_lock(&du.lock);
+		ds[n++] = (struct du_entry){ fi, du_start(dirfd, fi->name, &st) };
+		pthread_mutex_unlock(&du.lock);
+	}
+	pthread_mutex_lock(&du.lock);
+	for (size_t i = 0; i < n; i++)
+		while (!ds[i].dir->done) pthread_cond_wait(&du.done, &du.lock);
+	pthread_mutex_unlock(&du.lock);
+	// done directories do not change anymore
+	qsort(ds, n, sizeof(*ds), du_entry_cmp);
+	struct du_links counted = {0};
+	for (size_t i = 0; i < n; i++) {
+		const struct du_dir *d = ds[i].dir;
+		ds[i].fi->size = d->bytes + (d->links ? du_count(&counted, d) : 0);
+	}
+	free(counted.t);
+	free(ds);
+}
+
+// stat the staged entries [begin, v->len) relative to dirfd, dropping the ones
+// that fail; dir names dirfd in warnings, 0 if the names are paths; serial
+// keeps it on the calling thread
+static int ls_stat_all(file_list *v, size_t begin, int dirfd, const char *dir,
+	bool serial)
+{
+	struct stat_job j = {
+		.v = v, .begin = begin, .next = begin, .end = v->len,
+		.dirfd = dirfd, .need = stat_need,
+		.errs = xmalloc(v->len - begin, sizeof(int)),
+	};
+#ifdef HAVE_URING
+	if (options.uring && !serial && uring_stat_all(&j) == 0)
+		goto done;
+#endif
+	int n = serial ? 1 : stat_threads(j.end - j.next);
+	struct stat_thread *ts = xmalloc(n, sizeof(*ts));
+	pthread_t *tids = xmalloc(n, sizeof(*tids));
+	int started = 0;
+	for (int i = 0; i < n; i++)
+		ts[i] = (struct stat_thread){ .job = &j };
+	for (; started < n - 1; started++)
+		if (pthread_create(&tids[started], 0, stat_worker, &ts[started + 1]))
+			break;
+	stat_worker(&ts[0]);
+	for (int i = 0; i < started; i++)
+		pthread_join(tids[i], 0);
+	for (int i = 0; i < n; i++)
+		arena_adopt(&v->arena, &ts[i].arena);
+	free(ts);
+	free(tids);
+#ifdef HAVE_URING
+done:;
+#endif
+	int err = 0;
+	size_t o = begin;
+	for (size_t i = begin; i < j.end; i++) {
+		file_info *fi = fv_index(v, i);
+		if (j.errs[i - begin]) {
+			errno = j.errs[i - begin];
+			if (dir) warn_errno("cannot access '%s/%s'", dir, fi->name);
+			else warn_errno("cannot access '%s'", fi->name);
+			err = -1;
+			continue;
+		}
+		fv_account(v, fi);
+		if (o != i) fv_copy(fv_index(v, o), fi);
+		o++;
+	}
+	v->len = o;
+	free(j.errs);
+	if (options.du) du_sizes(v, begin, dirfd);
+	return err;
+}
+
+// --ignore and --only: shell patterns over the names of directory entries,
+// decided before anything is statted. A pattern is compiled once into the
+// cheapest test that gives the answer fnmatch with FNM_PERIOD would, so that
+// the usual literal names and *.ext patterns never get to fnmatch
+enum glob_kind {
+	GLOB_EXACT,   // name
+	GLOB_PREFIX,  // name*
+	GLOB_SUFFIX,  // *name
+	GLOB_INFIX,   // *name*
+	GLOB_ANY,     // *
+	GLOB_FNMATCH, // everything else
+};
+
+struct glob {
+	enum glob_kind kind;
+	const char *s; // the literal part, or the whole pattern for fnmatch
+	size_t len;
+};
+
+struct globs { struct glob *g; size_t n, cap; };
+
+static struct globs ignore_globs, only_globs;
+
+static void globs_add(struct globs *gs, const char *pattern) {
+	size_t len = strlen(pattern), lo = 0, hi = len;
+	struct glob g = { GLOB_FNMATCH, pattern, len };
+	if (hi && pattern[hi - 1] == '*') hi--;
+	if (lo < hi && pattern[0] == '*') lo++;
+	if (!strpbrk(pattern, "?[\\") && !memchr(pattern + lo, '*', hi - lo)) {
+		bool pre = lo, post = hi < len;
+		g.kind = len == 1 && pre + post ? GLOB_ANY :
+			pre && post ? GLOB_INFIX : pre ? GLOB_SUFFIX :
+			post ? GLOB_PREFIX : GLOB_EXACT;
+		g.s = pattern + lo;
+		g.len = hi - lo;
+	}
+	if (gs->n == gs->cap) {
+		gs->cap = MAX(8, gs->cap * 2);
+		gs->g = xrealloc(gs->g, gs->cap, sizeof(*gs->g));
+	}
+	gs->g[gs->n++] = g;
+}
+
+static bool globs_match(const struct globs *gs, const char *name, size_t len) {
+	for (size_t i = 0; i < gs->n; i++) {
+		const struct glob *g = &gs->g[i];
+		bool m = false;
+		switch (g->kind) {
+		case GLOB_EXACT:
+			m = len == g->len && !memcmp(name, g->s, len);
+			break;
+		case GLOB_PREFIX:
+			m = len >= g->len && !memcmp(name, g->s, g->len);
+			break;
+		// a leading '*' does not match the period of a dotfile
+		case GLOB_SUFFIX:
+			m = name[0] != '.' && len >= g->len &&
+				!memcmp(name + len - g->len, g->s, g->len);
+			break;
+		case GLOB_INFIX:
+			m = name[0] != '.' && memmem(name, len, g->s, g->len);
+			break;
+		case GLOB_ANY: m = name[0] != '.'; break;
+		case GLOB_FNMATCH: m = !fnmatch(g->s, name, FNM_PERIOD); break;
+		}
+		if (m) return true;
+	}
+	return false;
+}
+
+// --ignore-file: a pattern per line, empty lines and lines starting with '#'
+// are skipped
+static void globs_read(struct globs *gs, const char *path) {
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) die_errno("cannot open '%s'", path);
+	char *line = 0;
+	size_t cap = 0;
+	ssize_t n;
+	while ((n = getline(&line, &cap, f)) != -1) {
+		if (n && line[n - 1] == '\n') line[--n] = '\0';
+		if (!n || line[0] == '#') continue;
+		char *p = xmalloc(n + 1, 1);
+		memcpy(p, line, n + 1);
+		globs_add(gs, p);
+	}
+	if (ferror(f)) die_errno("cannot read '%s'", path);
+	free(line);
+	if (f != stdin) fclose(f);
+}
+
+// whether the directory entry called name is left out of the listing
+static bool ls_skip(const char *name, size_t len) {
+	if (name[0] == '.' && !options.all) return true;
+	if (globs_match(&ignore_globs, name, len)) return true;
+	return only_globs.n && !globs_match(&only_globs, name, len);
+}
+
+// --cache: the entries of directories are kept in dcache_dir, one file per
+// directory named after its device and inode. Entries are only created,
+// removed or renamed by calls that update the mtime and ctime of their
+// directory, and setting the mtime back still moves the ctime, so a stored
+// listing holds while both are unchanged. Changes in the same timestamp tick
+// as the read would go unnoticed, so directories changed less than
+// DCACHE_SETTLE seconds before are not stored. Only names, inode numbers and
+// types are kept, the rest is statted as usual.
+#define DCACHE_MAGIC 0x3163736c // "lsc1"
+#define DCACHE_SETTLE 2
+
+static char *dcache_dir;
+
+// file layout: the head, count records, then names_size bytes of names
+struct dcache_head {
+	uint32_t magic, count;
+	uint64_t dev, ino;
+	int64_t mtime, mtime_ns, ctime, ctime_ns;
+	uint64_t names_size;
+};
+
+struct dcache_rec {
+	uint64_t ino;
+	uint32_t name; // offset of the name
+	uint8_t type;
+};
+
+// the key of the open directory fd, false if it is not cached
+static bool dc_key(int fd, struct dcache_head *key, char *path, size_t size) {
+	struct stat st;
+	if (!dcache_dir || fstat(fd, &st) == -1) return false;
+	*key = (struct dcache_head){
+		.magic = DCACHE_MAGIC,
+		.dev = st.st_dev, .ino = st.st_ino,
+		.mtime = st.st_mtim.tv_sec, .mtime_ns = st.st_mtim.tv_nsec,
+		.ctime = st.st_ctim.tv_sec, .ctime_ns = st.st_ctim.tv_nsec,
+	};
+	int n = snprintf(path, size, "%s/%llx-%llx", dcache_dir,
+		(unsigned long long)key->dev, (unsigned long long)key->ino);
+	return n > 0 && (size_t)n < size;
+}
+
+// stage the stored entries if they match key
+static bool dc_load(file_list *v, const struct dcache_head *key,
+	const char *path)
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) return false;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*key))
+		map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+	const struct dcache_head *h = map;
+	const struct dcache_rec *recs = (const void *)(h + 1);
+	const char *names = (const char *)(recs + h->count);
+	bool ok = h->magic == key->magic && h->dev == key->dev &&
+		h->ino == key->ino && h->mtime == key->mtime &&
+		h->mtime_ns == key->mtime_ns && h->ctime == key->ctime &&
+		h->ctime_ns == key->ctime_ns &&
+		(uint64_t)st.st_size == sizeof(*h) + h->count * sizeof(*recs) +
+			h->names_size &&
+		(!h->names_size || !names[h->names_size - 1]);
+	for (uint32_t i = 0; ok && i < h->count; i++)
+		ok = recs[i].name < h->names_size;
+	for (uint32_t i = 0; ok && i < h->count; i++) {
+		const char *p = names + recs[i].name;
+		size_t len = strlen(p);
+		if (ls_skip(p, len)) continue;
+		file_info *fi = fv_stage(v);
+		fi->name = arena_strndup(&v->arena, p, len);
+		*fi_cold(fi) = (file_cold){ .ino = recs[i].ino, .type = recs[i].type };
+		fv_commit(v);
+	}
+	munmap(map, st.st_size);
+	return ok;
+}
+
+// store the entries [begin, v->len) under key, written to a temporary file
+// and renamed over the old one
+static void dc_store(file_list *v, size_t begin, const struct dcache_head *key,
+	const char *path)
+{
+	time_t now = time(0);
+	if (now - key->mtime < DCACHE_SETTLE || now - key->ctime < DCACHE_SETTLE)
+		return;
+	struct dcache_head h = *key;
+	h.count = v->len - begin;
+	for (size_t i = begin; i < v->len; i++)
+		h.names_size += strlen(fv_index(v, i)->name) + 1;
+	if (v->len - begin > UINT32_MAX || h.names_size > UINT32_MAX) return;
+	size_t size = sizeof(h) + h.count * sizeof(struct dcache_rec) + h.names_size;
+	char *buf = xmalloc(size, 1);
+	struct dcache_rec *recs = (void *)(buf + sizeof(h));
+	char *names = (char *)(recs + h.count);
+	memcpy(buf, &h, sizeof(h));
+	uint32_t off = 0;
+	for (size_t i = begin; i < v->len; i++) {
+		file_info *fi = fv_index(v, i);
+		file_cold *fc = fi_cold(fi);
+		size_t len = strlen(fi->name) + 1;
+		recs[i - begin] = (struct dcache_rec){ fc->ino, off, fc->type };
+		memcpy(names + off, fi->name, len);
+		off += len;
+	}
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", dcache_dir);
+	int fd = mkstemp(tmp);
+	if (fd != -1) {
+		bool ok = write(fd, buf, size) == (ssize_t)size;
+		if (close(fd) == -1 || !ok || rename(tmp, path) == -1)
+			unlink(tmp);
+	}
+	free(buf);
+}
+
+// drop the skipped entries of [begin, v->len), the store keeps them all
+static void ls_drop_skipped(file_list *v, size_t begin) {
+	size_t o = begin;
+	for (size_t i = begin; i < v->len; i++) {
+		file_info *fi = fv_index(v, i);
+		if (ls_skip(fi->name, strlen(fi->name))) continue;
+		if (o != i) fv_copy(fv_index(v, o), fi);
+		o++;
+	}
+	v->len = o;
+}
+
+// $XDG_CACHE_HOME/lsc or ~/.cache/lsc, created as needed
+static void dc_init(void) {
+	const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	char path[PATH_MAX];
+	int n;
+	if (xdg && *xdg) n = snprintf(path, sizeof(path), "%s", xdg);
+	else if (home && *home) n = snprintf(path, sizeof(path), "%s/.cache", home);
+	else return;
+	if (n < 0 || (size_t)n + 5 > sizeof(path)) return;
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) return;
+	strcat(path, "/lsc");
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) return;
+	dcache_dir = xmalloc(strlen(path) + 1, 1);
+	strcpy(dcache_dir, path);
+}
+
+// streamed directories are statted and printed in batches of this many entries
+#define STREAM_BATCH 1024
+// minimum width of the user and group columns while streaming
+#define STREAM_ID_WIDTH 8
+
+struct obuf;
+static void fmt_stream(struct obuf *out, file_list *v, size_t begin);
+
+// --head: the first options.head entries of a directory in output order are
+// kept in a heap at the front of its entries, the last of them on top, while
+// the others are read and statted in batches behind it. Names of entries that
+// make it into the heap are copied to an arena of its own, so the batches and
+// their names are dropped as soon as they are merged
+struct top {
+	size_t n; // entries in the heap
+	struct arena names;
+	size_t used, live; // bytes allocated in names, and still referenced
+};
+
+static size_t top_size(const file_info *fi) {
+	const file_cold *fc = fi_cold(fi);
+	return fi->name_len + 1 + (fc->linkname ? fc->linkname_len + 1 : 0);
+}
+
+static void top_keep(struct top *t, file_info *fi) {
+	file_cold *fc = fi_cold(fi);
+	fi->name = arena_strndup(&t->names, fi->name, fi->name_len);
+	if (fc->linkname)
+		fc->linkname = arena_strndup(&t->names, fc->linkname,
+			fc->linkname_len);
+	t->used += top_size(fi);
+	t->live += top_size(fi);
+}
+
+// copy the names in the heap to a fresh arena once most of them are gone
+static void top_compact(file_list *v, size_t begin, struct top *t) {
+	if (t->used < 2 * t->live + ARENA_CHUNK) return;
+	struct arena old = t->names;
+	t->names = (struct arena){0};
+	t->used = t->live = 0;
+	for (size_t i = 0; i < t->n; i++)
+		top_keep(t, fv_index(v, begin + i));
+	arena_free(&old);
+}
+
+static void top_swap(file_info *a, file_info *b) {
+	file_info t = *a;
+	file_cold tc = *fi_cold(a);
+	fv_copy(a, b);
+	*b = t;
+	*fi_cold(b) = tc;
+}
+
+static void top_up(file_list *v, size_t begin, size_t i) {
+	while (i) {
+		size_t p = (i - 1) / 2;
+		file_info *a = fv_index(v, begin + p), *b = fv_index(v, begin + i);
+		if (fi_cmp(a, b) >= 0) return;
+		top_swap(a, b);
+		i = p;
+	}
+}
+
+static void top_down(file_list *v, size_t begin, size_t n) {
+	for (size_t i = 0;;) {
+		size_t m = i, l = 2 * i + 1, r = l + 1;
+		if (l < n && fi_cmp(fv_index(v, begin + l), fv_index(v, begin + m)) > 0)
+			m = l;
+		if (r < n && fi_cmp(fv_index(v, begin + r), fv_index(v, begin + m)) > 0)
+			m = r;
+		if (m == i) return;
+		top_swap(fv_index(v, begin + i), fv_index(v, begin + m));
+		i = m;
+	}
+}
+
+// stat the batch behind the heap and merge it in
+static int top_batch(file_list *v, size_t begin, struct top *t, int dirfd,
+	const char *name, bool serial)
+{
+	size_t start = begin + t->n;
+	int err = ls_stat_all(v, start, dirfd, name, serial);
+	for (size_t i = start; i < v->len; i++) {
+		file_info *fi = fv_index(v, i);
+		if (t->n < options.head) {
+			file_info *slot = fv_index(v, begin + t->n);
+			fv_copy(slot, fi);
+			top_keep(t, slot);
+			top_up(v, begin, t->n++);
+			continue;
+		}
+		file_info *root = fv_index(v, begin);
+		if (fi_cmp(fi, root) >= 0) continue;
+		t->live -= top_size(root);
+		fv_copy(root, fi);
+		top_keep(t, root);
+		top_down(v, begin, t->n);
+	}
+	v->len = begin + t->n;
+	if (!begin) arena_reset(&v->arena);
+	top_compact(v, begin, t);
+	return err;
+}
+
+// read and stat the entries of the open directory name, if out is set the
+// entries are printed as they are read instead of being collected
+static int ls_entries(file_list *v, struct ls_dir *dir, const char *name,
+	struct obuf *out, bool serial)
+{
+	struct ls_dirent dent = {0};
+	size_t begin = v->len;
+	int err = 0, r = 0;
+	// without sorting the first entries read are the first ones listed
+	size_t limit = options.head && options.unsorted ? options.head : SIZE_MAX;
+	struct top top = {0};
+	bool head = options.head && !options.unsorted;
+	if (out && options.userinfo != UINFO_NEVER) {
+		// whether any entry is foreign is not known up front
+		v->userinfo = true;
+		v->uwidth = MAX(v->uwidth, STREAM_ID_WIDTH);
+		v->gwidth = MAX(v->gwidth, STREAM_ID_WIDTH);
+	}
+	struct dcache_head key = {0};
+	char path[PATH_MAX];
+	bool cache = !out && !head && dc_key(dir->fd, &key, path, sizeof(path));
+	if (cache) {
+		if (dc_load(v, &key, path)) {
+			prof_count(PROF_CACHE_HITS, 1);
+			goto stat;
+		}
+		prof_count(PROF_CACHE_MISSES, 1);
+		v->len = begin;
+	}
+	while (v->flushed + v->len - begin < limit &&
+	    (r = ld_next(dir, &dent)) == 1) {
+		const char *p = dent.name;
+		if (p[0] == '.' && p[1] == '\0') continue;
+		if (p[0] == '.' && p[1] == '.' && p[2] == '\0') continue;
+		size_t len = strlen(p);
+		if (!cache && ls_skip(p, len)) continue;
+		file_info *fi = fv_stage(v);
+		fi->name = arena_strndup(&v->arena, p, len);
+		*fi_cold(fi) = (file_cold){ .ino = dent.ino, .type = dent.type };
+		fv_commit(v);
+		if (out && v->len - begin == STREAM_BATCH) {
+			err |= ls_stat_all(v, begin, dir->fd, name, serial);
+			fmt_stream(out, v, begin);
+		}
+		if (head && v->len - begin - top.n == STREAM_BATCH)
+			err |= top_batch(v, begin, &top, dir->fd, name, serial);
+	}
+	if (r == -1) {
+		warn_errno("cannot read directory '%s'", name);
+		err = -1;
+	}
+	if (cache) {
+		if (!err) dc_store(v, begin, &key, path);
+		ls_drop_skipped(v, begin);
+	}
+stat:
+	if (head) {
+		err |= top_batch(v, begin, &top, dir->fd, name, serial);
+		arena_adopt(&v->arena, &top.names);
+		// only the entries that are listed decide whether owners are
+		if (!begin) v->userinfo = options.userinfo == UINFO_ALWAYS;
+		for (size_t i = begin; i < v->len; i++)
+			fv_account(v, fv_index(v, i));
+		return err;
+	}
+	err |= ls_stat_all(v, begin, dir->fd, name, serial);
+	if (out) fmt_stream(out, v, begin);
+	return err;
+}
+
+// list directory, streamed to out if it is set
+static int ls_readdir(file_list *v, const char *name, struct obuf *out,
+	bool serial)
+{
+	struct ls_dir dir;
+	if (ld_open(&dir, AT_FDCWD, name) == -1) {
+		warn_errno("cannot open directory '%s'", name);
+		return -1;
+	}
+	int err = ls_entries(v, &dir, name, out, serial);
+	if (ld_close(&dir) == -1)
+		return -1;
+	return err;
+}
+
+// list file/directory, directories are streamed if stream is set
+static int ls(file_list *v, const char *name, struct obuf *stream,
+	bool serial)
+{
+	file_info *out = fv_stage(v); // new uninitialized file_info
+	out->name = name;
+	*fi_cold(out) = (file_cold){ .type = DT_UNKNOWN };
+	// operands are always followed to see whether they are directories
+	if (ls_stat(out, &v->arena, AT_FDCWD, stat_need|NEED_LINKTYPE) == -1) {
+		warn_errno("cannot access '%s'", name);
+		return -1;
+	}
+	if (!options.dir && fi_isdir(out)) {
+		v->dir = name;
+		return ls_readdir(v, name, stream, serial);
+	}
+	fv_account(v, out);
+	fv_commit(v);
+	if (options.du) du_sizes(v, v->len - 1, AT_FDCWD);
+	return 0;
+}
+
+enum ls_color_labels {
+	L_LEFT, L_RIGHT, L_END, L_RESET, L_NORM, L_FILE, L_DIR, L_LINK, L_FIFO,
+	L_SOCK, L_BLK, L_CHR, L_MISSING, L_ORPHAN, L_EXEC, L_DOOR, L_SETUID,
+	L_SETGID, L_STICKY, L_OW, L_STICKYOW, L_CAP, L_MULTIHARDLINK, L_CLR_TO_EOL,
+	L_LENGTH,
+};
+
+// extension colour, the key is the pattern without the leading '*'
+struct lsc_ext {
+	const char *ext, *color;
+	size_t len;
+	uint32_t hash;
+};
+
+struct {
+	char *labels[L_LENGTH];
+	struct lsc_ext *map; // open addressing, map_mask + 1 slots
+	size_t map_mask, exts;
+	size_t ext_max; // length of the longest extension
+} ls_colors;
+
+static const char *const lsc_labels[] = {
+	"lc", "rc", "ec", "rs", "no", "fi", "di", "ln",
+	"pi", "so", "bd", "cd", "mi", "or", "ex", "do",
+	"su", "sg", "st", "ow", "tw", "ca", "mh", "cl", NULL,
+};
+
+static uint32_t lsc_hash(const char *s, size_t len) {
+	uint32_t h = 2166136261u; // fnv-1a
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+// slot of ext, or the empty slot it would go into
+static struct lsc_ext *lsc_slot(const char *ext, size_t len, uint32_t h) {
+	size_t i = h & ls_colors.map_mask;
+	for (;; i = (i + 1) & ls_colors.map_mask) {
+		struct lsc_ext *e = &ls_colors.map[i];
+		if (!e->ext || (e->hash == h && e->len == len &&
+		    !memcmp(e->ext, ext, len)))
+			return e;
+	}
+}
+
+static void lsc_parse(char *lsc_env) {
+	if (!lsc_env) return;
+	size_t exts = 0;
+	size_t len = strlen(lsc_env);
+	for (size_t i = 0; i < len; i++) if (lsc_env[i] == '*') exts++;
+	size_t slots = 1;
+	while (slots < 2 * exts) slots *= 2;
+	ls_colors.map = calloc(slots, sizeof(*ls_colors.map));
+	assertx(ls_colors.map);
+	ls_colors.map_mask = slots - 1;
+	bool eq = false;
+	size_t kbegin = 0, kend = 0;
+	for (size_t i = 0; i < len; i++) {
+		char c = lsc_env[i];
+		if (c == '=') { kend = i; eq = true; continue; }
+		if (!eq || c != ':') continue;
+		lsc_env[kend] = lsc_env[i] = '\0';
+		char *k = lsc_env + kbegin;
+		char *v = lsc_env + kend + 1;
+		if (*k == '*') {
+			size_t n = kend - kbegin - 1;
+			uint32_t h = lsc_hash(k + 1, n);
+			struct lsc_ext *e = lsc_slot(k + 1, n, h);
+			ls_colors.exts += !e->ext;
+			*e = (struct lsc_ext){ k + 1, v, n, h }; // later entries win
+			ls_colors.ext_max = MAX(ls_colors.ext_max, n);
+		} else if (kend - kbegin == 2)
+			for (size_t i = 0; i < L_LENGTH; i++)
+				if (k[0] == lsc_labels[i][0] && k[1] == lsc_labels[i][1]) {
+					ls_colors.labels[i] = v;
+					break;
+				}
+		kbegin = i + 1;
+		i += 2;
+		eq = false;
+	}
+}
+
+static bool lsc_same(int a, int b) {
+	const char *x = ls_colors.labels[a], *y = ls_colors.labels[b];
+	return x == y || (x && y && !strcmp(x, y));
+}
+
+// decide which metadata the active options need, colours have to be parsed
+static void stat_plan(void) {
+	unsigned need = 0;
+	if (options.strmode) need |= NEED_MODE;
+	if (options.size || options.sort == SORT_SIZE || options.du)
+		need |= NEED_SIZE;
+	if (options.date != DATE_NONE || options.sort == SORT_TIME)
+		need |= NEED_TIME;
+	if (options.userinfo != UINFO_NEVER) need |= NEED_OWNER;
+	if (!options.no_group_dir) need |= NEED_LINKTYPE;
+	if (options.follow_links) need |= NEED_LINKNAME|NEED_LINKMODE;
+	if (options.output == OUTPUT_JSON || options.output == OUTPUT_BINARY)
+		need |= NEED_INO;
+	// executables are classified, and coloured unless ex/su/sg match fi
+	// and there are no extension colours that only plain files get
+	if (!options.no_classify || ls_colors.exts || !lsc_same(L_EXEC, L_FILE) ||
+	    !lsc_same(L_SETUID, L_FILE) || !lsc_same(L_SETGID, L_FILE))
+		need |= NEED_MODE_REG;
+	if (!lsc_same(L_STICKYOW, L_DIR) || !lsc_same(L_OW, L_DIR) ||
+	    !lsc_same(L_STICKY, L_DIR))
+		need |= NEED_MODE_DIR;
+	stat_need = need;
+}
+
+// user and group names, each id is resolved once per run; the caches are
+// shared by the threads of the pool, entries are never moved or freed so they
+// stay valid after the lock is dropped
+struct idname {
+	id_t id;
+	int width; // of the name, or of the number if there is none
+	const char *name;
+	char buf[];
+};
+
+// open addressing, mask + 1 slots at most half full
+struct idcache {
+	struct idname **slots;
+	size_t mask, len;
+	bool swept; // enumerated through getpwent/getgrent, see -P
+};
+
+#define IDCACHE_MIN 64
+#define ID_PRELOAD_MIN 32 // distinct ids before -P enumerates all of them
+
+static pthread_mutex_t idcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct idcache ucache, gcache;
+static __thread struct idname *ulast, *glast; // last hits of the thread
+
+static int strwidth(const char *s);
+
+static struct idname **id_slot(struct idcache *c, id_t id) {
+	size_t i = (uint32_t)id * 2654435761u & c->mask;
+	while (c->slots[i] && c->slots[i]->id != id)
+		i = (i + 1) & c->mask;
+	return &c->slots[i];
+}
+
+static struct idname *id_find(struct idcache *c, id_t id) {
+	return c->slots ? *id_slot(c, id) : 0;
+}
+
+// the first name of an id wins, as with getpwuid
+static struct idname *id_put(struct idcache *c, id_t id, const char *name) {
+	if (2 * (c->len + 1) > (c->slots ? c->mask + 1 : 0)) {
+		struct idcache old = *c;
+		c->mask = c->slots ? 2 * c->mask + 1 : IDCACHE_MIN - 1;
+		c->slots = calloc(c->mask + 1, sizeof(*c->slots));
+		assertx(c->slots);
+		for (size_t i = 0; old.slots && i <= old.mask; i++)
+			if (old.slots[i]) *id_slot(c, old.slots[i]->id) = old.slots[i];
+		free(old.slots);
+	}
+	struct idname **s = id_slot(c, id);
+	if (*s) return *s;
+	size_t len = name ? strlen(name) : 0;
+	struct idname *n = xmalloc(sizeof(*n) + len + 1, 1);
+	n->id = id;
+	n->name = 0;
+	if (name) {
+		memcpy(n->buf, name, len + 1);
+		n->name = n->buf;
+	}
+	n->width = name ? strwidth(name) : snprintf(0, 0, "%d", (int)id);
+	c->len++;
+	return *s = n;
+}
+
+static void id_sweep_users(void) {
+	struct passwd *e;
+	setpwent();
+	while ((e = getpwent())) id_put(&ucache, e->pw_uid, e->pw_name);
+	endpwent();
+	ucache.swept = true;
+}
+
+static void id_sweep_groups(void) {
+	struct group *e;
+	setgrent();
+	while ((e = getgrent())) id_put(&gcache, e->gr_gid, e->gr_name);
+	endgrent();
+	gcache.swept = true;
+}
+
+static const struct idname *getuser(uid_t id) {
+	if (ulast && ulast->id == id) return ulast;
+	uint64_t t = prof_start();
+	pthread_mutex_lock(&idcache_lock);
+	struct idname *n = id_find(&ucache, id);
+	if (!n && options.preload && !ucache.swept &&
+	    ucache.len >= ID_PRELOAD_MIN) {
+		id_sweep_users();
+		n = id_find(&ucache, id);
+	}
+	if (!n) {
+		// ids missing from the enumeration may still resolve
+		prof_count(PROF_NSS_MISSES, 1);
+		struct passwd *e = getpwuid(id);
+		n = id_put(&ucache, id, e ? e->pw_name : 0);
+	}
+	pthread_mutex_unlock(&idcache_lock);
+	prof_end(PROF_IDS, t);
+	return ulast = n;
+}
+
+static const struct idname *getgroup(gid_t id) {
+	if (glast && glast->id == id) return glast;
+	uint64_t t = prof_start();
+	pthread_mutex_lock(&idcache_lock);
+	struct idname *n = id_find(&gcache, id);
+	if (!n && options.preload && !gcache.swept &&
+	    gcache.len >= ID_PRELOAD_MIN) {
+		id_sweep_groups();
+		n = id_find(&gcache, id);
+	}
+	if (!n) {
+		prof_count(PROF_NSS_MISSES, 1);
+		struct group *e = getgrgid(id);
+		n = id_put(&gcache, id, e ? e->gr_name : 0);
+	}
+	pthread_mutex_unlock(&idcache_lock);
+	prof_end(PROF_IDS, t);
+	return glast = n;
+}
+
+// output buffer, rows are rendered into it and written out in large chunks
+// with write(2), bypassing stdio; with fd -1 the output is kept in memory
+#define OBUF_SIZE (256 * 1024)
+#define OBUF_MEM_SIZE 4096 // initial size of in-memory buffers
+
+struct obuf {
+	char *buf;
+	size_t len, cap;
+	int fd;
+};
+
+static void ob_init(struct obuf *o, int fd) {
+	o->cap = fd == -1 ? OBUF_MEM_SIZE : OBUF_SIZE;
+	o->buf = xmalloc(o->cap, 1);
+	o->len = 0;
+	o->fd = fd;
+}
+
+// write the buffer followed by n bytes of p, in memory the buffer grows
+// to take them instead
+static void ob_writev(struct obuf *o, const void *p, size_t n) {
+	if (o->fd == -1) {
+		o->cap = MAX(o->cap * 2, o->len + n);
+		o->buf = xrealloc(o->buf, o->cap, 1);
+		if (n) memcpy(o->buf + o->len, p, n);
+		o->len += n;
+		return;
+	}
+	struct iovec iov[2] = {
+		{ .iov_base = o->buf, .iov_len = o->len },
+		{ .iov_base = (void *)p, .iov_len = n },
+	};
+	struct iovec *v = iov;
+	int cnt = 2;
+	uint64_t t = prof_start();
+	prof_count(PROF_BYTES, o->len + n);
+	while (cnt) {
+		ssize_t r = writev(o->fd, v, cnt);
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			die_errno("%s", "write error");
+		}
+		for (; cnt && (size_t)r >= v->iov_len; cnt--, v++)
+			r -= v->iov_len;
+		if (cnt) {
+			v->iov_base = (char *)v->iov_base + r;
+			v->iov_len -= r;
+		}
+	}
+	prof_end(PROF_FLUSH, t);
+	o->len = 0;
+}
+
+static void ob_flush(struct obuf *o) {
+	if (o->len && o->fd != -1) ob_writev(o, 0, 0);
+}
+
+static void ob_write(struct obuf *o, const void *p, size_t n) {
+	if (!n) return; // p may be 0 then
+	if (o->cap - o->len < n) {
+		if (n >= o->cap / 2) {
+			ob_writev(o, p, n);
+			return;
+		}
+		ob_writev(o, 0, 0);
+	}
+	memcpy(o->buf + o->len, p, n);
+	o->len += n;
+}
+
+#define ob_lit(o, s) ob_write(o, s, sizeof(s) - 1)
+
+static void ob_puts(struct obuf *o, const char *s) { ob_write(o, s, strlen(s)); }
+
+static void ob_putc(struct obuf *o, char c) {
+	if (o->len == o->cap) ob_writev(o, 0, 0);
+	o->buf[o->len++] = c;
+}
+
+// n spaces
+static void ob_pad(struct obuf *o, int n) {
+	while (n > 0) {
+		if (o->len == o->cap) ob_writev(o, 0, 0);
+		size_t k = MIN((size_t)n, o->cap - o->len);
+		memset(o->buf + o->len, ' ', k);
+		o->len += k;
+		n -= k;
+	}
+}
+
+static void ob_uint(struct obuf *o, unsigned long long u) {
+	char b[24], *p = b + sizeof(b);
+	do *--p = '0' + u % 10; while (u /= 10);
+	ob_write(o, p, b + sizeof(b) - p);
+}
+
+static void ob_int(struct obuf *o, long long x) {
+	char b[24], *p = b + sizeof(b);
+	unsigned long long u = x < 0 ? -(unsigned long long)x : (unsigned long long)x;
+	do *--p = '0' + u % 10; while (u /= 10);
+	if (x < 0) *--p = '-';
+	ob_write(o, p, b + sizeof(b) - p);
+}
+
+// rendered mode strings of the modes seen recently, there are few of them
+#define MODE_MEMO 64
+#define MODE_STR_MAX 256
+
+static __thread struct mode_memo {
+	mode_t mode;
+	unsigned char len; // 0 if the slot is empty
+	char s[MODE_STR_MAX];
+} mode_memo[MODE_MEMO];
+
+#define str_put(b, n, s) (memcpy((b) + (n), s, strlen(s)), (n) += strlen(s))
+
+static size_t strmode_render(char *b, const mode_t mode) {
+	size_t n = 0;
+	switch (mode&S_IFMT) {
+	case S_IFREG:  str_put(b, n, C_FILE); break;
+	case S_IFDIR:  str_put(b, n, C_DIR); break;
+	case S_IFCHR:  str_put(b, n, C_CHAR); break;
+	case S_IFBLK:  str_put(b, n, C_BLOCK); break;
+	case S_IFIFO:  str_put(b, n, C_FIFO); break;
+	case S_IFLNK:  str_put(b, n, C_LINK); break;
+	case S_IFSOCK: str_put(b, n, C_SOCK); break;
+	default:       str_put(b, n, C_UNKNOWN); break;
+	}
+	str_put(b, n, mode&S_IRUSR ? C_READ : C_NONE);
+	str_put(b, n, mode&S_IWUSR ? C_WRITE : C_NONE);
+	str_put(b, n, mode&S_ISUID ? mode&S_IXUSR ? C_UID_EXEC : C_UID
+	                           : mode&S_IXUSR ? C_EXEC : C_NONE);
+	str_put(b, n, mode&S_IRGRP ? C_READ : C_NONE);
+	str_put(b, n, mode&S_IWGRP ? C_WRITE : C_NONE);
+	str_put(b, n, mode&S_ISGID ? mode&S_IXGRP ? C_UID_EXEC : C_UID
+	                           : mode&S_IXGRP ? C_EXEC : C_NONE);
+	str_put(b, n, mode&S_IROTH ? C_READ : C_NONE);
+	str_put(b, n, mode&S_IWOTH ? C_WRITE : C_NONE);
+	str_put(b, n, mode&S_ISVTX ? mode&S_IXOTH ? C_STICKY : C_STICKY_O
+	                           : mode&S_IXOTH ? C_EXEC : C_NONE);
+	str_put(b, n, "\033[38;5;235m ▏\033[0m");
+	return n;
+}
+
+static void fmt_strmode(struct obuf *out, const mode_t mode) {
+	struct mode_memo *m = &mode_memo[(mode ^ mode >> 6) % MODE_MEMO];
+	if (!m->len || m->mode != mode) {
+		char b[MODE_STR_MAX * 2];
+		size_t n = strmode_render(b, mode);
+		assertx(n < MODE_STR_MAX); // colours too long for the memo
+		memcpy(m->s, b, n);
+		m->len = n;
+		m->mode = mode;
+	}
+	ob_write(out, m->s, m->len);
+}
+
+#define SECOND 1
+#define MINUTE (60 * SECOND)
+#define HOUR   (60 * MINUTE)
+#define DAY    (24 * HOUR)
+#define WEEK   (7  * DAY)
+#define MONTH  (30 * DAY)
+#define YEAR   (12 * MONTH)
+
+time_t now;
+
+static void get_current_time(void) {
+	struct timespec t;
+	if (clock_gettime(CLOCK_REALTIME, &t) == -1)
+		die_errno("%s", "current_time");
+	now = t.tv_sec;
+}
+
+static void fmt_abstime(struct obuf *out, const time_t then) {
+	time_t diff = now - then;
+	char buf[20];
+	struct tm tm;
+	localtime_r(&then, &tm);
+	char *fmt = diff < MONTH * 6 ? "%e %b %H:%M" : "%e %b  %Y";
+	strftime(buf, sizeof(buf), fmt, &tm);
+	ob_lit(out, C_DAY);
+	ob_puts(out, buf);
+	ob_lit(out, "\033[38;5;235m ▏\033[0m");
+}
+
+static void fmt3(char b[static 3], int x) {
+	if (x/100) b[0] = '0' + x/100;
+	if (x/100||x/10%10) b[1] = '0' + x/10%10;
+	b[2] = '0' + x%10;
+}
+
+// relative times below 100 of each unit, rendered by fmt_plan
+#define RELTIME_MAX 64
+#define RELTIME_UNITS 6
+
+static struct reltime_cell { unsigned char len; char s[RELTIME_MAX]; }
+	reltime_tab[RELTIME_UNITS][100];
+
+static const struct reltime_unit {
+	const char *color;
+	time_t div;
+	char unit;
+} reltime_units[RELTIME_UNITS] = {
+	{ C_SECOND, SECOND, 's' }, { C_MINUTE, MINUTE, 'm' },
+	{ C_HOUR, HOUR, 'h' }, { C_DAY, DAY, 'd' }, { C_WEEK, WEEK, 'w' },
+	{ C_YEAR, YEAR, 'y' },
+};
+
+static size_t reltime_render(char *s, const struct reltime_unit *u, int x) {
+	size_t n = 0;
+	char b[4] = "  0 ";
+	fmt3(b, x);
+	b[3] = u->unit;
+	str_put(s, n, u->color);
+	memcpy(s + n, b + 1, 3);
+	n += 3;
+	s[n++] = ' ';
+	str_put(s, n, "\033[38;5;235m ▏\033[0m");
+	return n;
+}
+
+static void reltime_init(void) {
+	for (int u = 0; u < RELTIME_UNITS; u++)
+		for (int x = 0; x < 100; x++) {
+			struct reltime_cell *c = &reltime_tab[u][x];
+			char b[RELTIME_MAX * 2];
+			size_t n = reltime_render(b, &reltime_units[u], x);
+			assertx(n < RELTIME_MAX);
+			memcpy(c->s, b, n);
+			c->len = n;
+		}
+}
+
+static void fmt_reltime(struct obuf *out, const time_t then) {
+	time_t diff = now - then;
+	if (diff < 0) {
+		ob_lit(out, C_SECOND " 0s " C_END);
+		ob_lit(out, "\033[38;5;235m ▏\033[0m");
+		return;
+	}
+	if (diff <= SECOND) {
+		ob_lit(out, C_SECOND "<1s " C_END);
+		ob_lit(out, "\033[38;5;235m ▏\033[0m");
+		return;
+	}
+	int u = diff < MINUTE ? 0 : diff < HOUR ? 1 : diff < HOUR*36 ? 2 :
+		diff < MONTH ? 3 : diff < YEAR ? 4 : 5;
+	diff /= reltime_units[u].div;
+	if (diff < 100) {
+		const struct reltime_cell *c = &reltime_tab[u][diff];
+		ob_write(out, c->s, c->len);
+		return;
+	}
+	char b[RELTIME_MAX * 2];
+	ob_write(out, b, reltime_render(b, &reltime_units[u], diff % 1000));
+}
+
+static const char *const C_SIZES[7] = { "B", "K", "M", "G", "T", "P", "E" };
+
+static off_t divide(off_t x, off_t d) { return (x+(d-1)/2)/d; }
+
+// TODO: make this reusable
+static void fmt_size(struct obuf *out, off_t sz) {
+	ob_lit(out, C_SIZE);
+	int m = 0;
+	off_t div = 1, u = sz;
+	while (u > 999) {
+		div *= 1024;
+		u = divide(u, 1024);
+		m++;
+	}
+	off_t v = divide(sz*10, div);
+	char b[3] = "  0";
+	if (v/10 >= 10 || m == 0) {
+		fmt3(b, u);
+	} else if (sz != 0) {
+		b[0] = '0' + v/10;
+		b[1] = '.';
+		b[2] = '0' + v%10;
+	}
+	ob_write(out, b, 3);
+	ob_puts(out, C_SIZES[m]);
+	ob_putc(out, ' ');
 }
 
 static int color_type(mode_t mode) {
@@ -567,11 +2488,44 @@ static int color_type(mode_t mode) {
 	}
 }
 
+// recently looked up suffixes, names in a directory tend to share a few
+#define LSC_MEMO 256
+#define LSC_MEMO_LEN 16
+
+static __thread struct lsc_memo {
+	char suf[LSC_MEMO_LEN];
+	unsigned char len;
+	const char *color;
+} lsc_memo[LSC_MEMO];
+
+// colour of the longest extension pattern that matches from a dot in name
 static const char *suf_color(const char *name, size_t len) {
-	while (len--)
-		if (name[len] == '.')
-			return lsc_lookup(name + len);
-	return 0;
+	if (!ls_colors.exts) return 0;
+	size_t i = len > ls_colors.ext_max ? len - ls_colors.ext_max : 0;
+	while (i < len && name[i] != '.') i++;
+	if (i == len) return 0;
+	const char *s = name + i;
+	size_t n = len - i;
+	uint32_t h = lsc_hash(s, n);
+	struct lsc_memo *m = 0;
+	if (n <= LSC_MEMO_LEN) {
+		m = &lsc_memo[h % LSC_MEMO];
+		if (m->len == n && !memcmp(m->suf, s, n)) return m->color;
+	}
+	const char *c = 0;
+	for (size_t j = 0; j < n; j++) {
+		if (s[j] != '.') continue;
+		prof_count(PROF_LSC_LOOKUPS, 1);
+		struct lsc_ext *e = lsc_slot(s + j, n - j,
+			j ? lsc_hash(s + j, n - j) : h);
+		if (e->ext) { c = e->color; break; }
+	}
+	if (m) {
+		memcpy(m->suf, s, n);
+		m->len = n;
+		m->color = c;
+	}
+	return c;
 }
 
 static const char *file_color(const char *name, size_t len, int t) {
@@ -582,118 +2536,468 @@ static const char *file_color(const char *name, size_t len, int t) {
 	return ls_colors.labels[t];
 }
 
+// length of the printable ascii prefix of s, which is also its width
+static size_t ascii_span_scalar(const char *s, size_t len) {
+	size_t i = 0;
+	while (i < len && (unsigned char)s[i] - 0x20u < 0x5f) i++;
+	return i;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+static size_t ascii_span_sse2(const char *s, size_t len) {
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(c, lo),
+			_mm_cmplt_epi8(c, hi));
+		unsigned m = ~_mm_movemask_epi8(ok) & 0xffff;
+		if (m) return i + __builtin_ctz(m);
+	}
+	return i + ascii_span_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_span_avx2(const char *s, size_t len) {
+	const __m256i lo = _mm256_set1_epi8(0x1f), hi = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(c, lo),
+			_mm256_cmpgt_epi8(hi, c));
+		unsigned m = ~(unsigned)_mm256_movemask_epi8(ok);
+		if (m) return i + __builtin_ctz(m);
+	}
+	return i + ascii_span_sse2(s + i, len - i);
+}
+
+static size_t (*ascii_span)(const char *s, size_t len) = ascii_span_sse2;
+
+static void init_strwidth(void) {
+	if (__builtin_cpu_supports("avx2")) ascii_span = ascii_span_avx2;
+}
+#else
+#define ascii_span ascii_span_scalar
+static void init_strwidth(void) {}
+#endif
+
+static bool utf8_locale; // decode names without mbrtowc
+
+// like mbrtowc for utf-8, returns (size_t)-1 on invalid and (size_t)-2 on
+// incomplete sequences
+static size_t utf8_decode(const char *p, size_t n, wchar_t *wc) {
+	const unsigned char *s = (const unsigned char *)p;
+	unsigned long c = s[0], min;
+	size_t len;
+	if (c < 0xc2) return -1;
+	if (c < 0xe0) len = 2, c &= 0x1f, min = 0x80;
+	else if (c < 0xf0) len = 3, c &= 0x0f, min = 0x800;
+	else if (c < 0xf5) len = 4, c &= 0x07, min = 0x10000;
+	else return -1;
+	for (size_t i = 1; i < len; i++) {
+		if (i >= n) return -2;
+		if ((s[i] & 0xc0) != 0x80) return -1;
+		c = c << 6 | (s[i] & 0x3f);
+	}
+	if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+		return -1;
+	*wc = c;
+	return len;
+}
+
+// wcwidth of the basic multilingual plane, + 2 and 0 while unknown
+static unsigned char wcw_memo[0x10000];
+
+static int wc_width(wchar_t wc) {
+	if ((unsigned long)wc >= sizeof(wcw_memo)) return wcwidth(wc);
+	unsigned char m = __atomic_load_n(&wcw_memo[wc], __ATOMIC_RELAXED);
+	if (!m) {
+		m = wcwidth(wc) + 2;
+		__atomic_store_n(&wcw_memo[wc], m, __ATOMIC_RELAXED);
+	}
+	return m - 2;
+}
+
+// display width, up to the first invalid sequence; control characters take
+// no space
 static int strwidth(const char *s) {
 	mbstate_t st = {0};
 	wchar_t wc;
-	int len = strlen(s), w = 0, i = 0;
-	while (i < len) {
-		int c = (unsigned char)s[i];
-		if (c <= 0x7f) { // ascii fast path
-			if (0x7f > c && c > 0x1f) { w++, i++; }
-			continue;
-		}
-		int r = mbrtowc(&wc, s+i, len-i, &st);
-		if (r < 0) break;
-		w += wcwidth(wc);
+	size_t len = strlen(s), i = 0;
+	int w = 0;
+	for (;;) {
+		size_t n = ascii_span(s + i, len - i);
+		w += n, i += n;
+		if (i == len) break;
+		if ((unsigned char)s[i] < 0x80) { i++; continue; }
+		size_t r = utf8_locale ? utf8_decode(s + i, len - i, &wc) :
+			mbrtowc(&wc, s + i, len - i, &st);
+		if (r == (size_t)-1 || r == (size_t)-2) break;
+		w += wc_width(wc);
 		i += r;
 	}
 	return w;
 }
 
 static int fmt_name_width(const file_info *fi) {
+	const file_cold *fc = fi_cold(fi);
 	int w = strwidth(fi->name);
-	if (options.follow_links && fi->linkname) {
-		w += 1 + strlen(C_SYM_DELIM) + strwidth(fi->linkname);
+	if (options.follow_links && fc->linkname) {
+		w += 1 + strlen(C_SYM_DELIM) + strwidth(fc->linkname);
 	}
 	if (!options.no_classify) {
-		mode_t m = fi->linkname && options.follow_links ? fi->linkmode : fi->mode;
+		mode_t m = fc->linkname && options.follow_links ? fi->linkmode : fi->mode;
 		w += (S_ISREG(m) && m&S_IXUGO) || S_ISDIR(m) || S_ISLNK(m) ||
 			S_ISFIFO(m) || S_ISSOCK(m);
 	}
-	return w;
+	return w;
+}
+
+static void fmt_name(struct obuf *out, const file_info *fi) {
+	const file_cold *fc = fi_cold(fi);
+	int t;
+	const char *c;
+	if (fc->linkname && options.follow_links) {
+		t = fc->linkok ? color_type(fi->linkmode) : L_ORPHAN;
+		c = file_color(fc->linkname, fc->linkname_len, t);
+	} else {
+		t = color_type(fi->mode);
+		c = file_color(fi->name, fi->name_len, t);
+	}
+	ob_lit(out, C_ESC);
+	ob_puts(out, c ? c : "0");
+	ob_lit(out, "m");
+	ob_write(out, fi->name, fi->name_len);
+	if (c) ob_lit(out, C_END);
+	if (options.follow_links && fc->linkname) {
+		ob_lit(out, " " C_SYM_DELIM_COLOR C_SYM_DELIM C_ESC);
+		ob_puts(out, c ? c : "0");
+		ob_lit(out, "m");
+		ob_write(out, fc->linkname, fc->linkname_len);
+		if (c) ob_lit(out, C_END);
+	}
+	if (!options.no_classify) {
+		mode_t m = fc->linkname && options.follow_links ? fi->linkmode : fi->mode;
+		if (S_ISREG(m) && m&S_IXUGO) ob_lit(out, CL_EXEC);
+		else if S_ISDIR(m) ob_lit(out, CL_DIR);
+		else if S_ISLNK(m) ob_lit(out, CL_LINK);
+		else if S_ISFIFO(m) ob_lit(out, CL_FIFO);
+		else if S_ISSOCK(m) ob_lit(out, CL_SOCK);
+	}
+}
+
+static void fmt_usergroup(struct obuf *out, const struct idname *n, int mw) {
+	if (n->name) ob_puts(out, n->name);
+	else ob_int(out, (int)n->id);
+	ob_pad(out, mw - n->width + 1);
+}
+
+static void fmt_userinfo(struct obuf *out, file_list *l, file_info *fi) {
+	const file_cold *fc = fi_cold(fi);
+	ob_lit(out, C_USERINFO);
+	fmt_usergroup(out, getuser(fc->uid), l->uwidth);
+	fmt_usergroup(out, getgroup(fc->gid), l->gwidth);
+}
+
+// the columns before the name, resolved once by fmt_plan
+typedef void fmt_column(struct obuf *out, file_list *l, file_info *fi);
+
+static fmt_column *fmt_columns[4];
+static int fmt_ncolumns;
+static int fmt_columns_width; // of the columns but user and group
+
+static void fmt_col_mode(struct obuf *out, file_list *l, file_info *fi) {
+	(void)l;
+	fmt_strmode(out, fi->mode);
+}
+
+static void fmt_col_userinfo(struct obuf *out, file_list *l, file_info *fi) {
+	if (l->userinfo) fmt_userinfo(out, l, fi);
+}
+
+static void fmt_col_abstime(struct obuf *out, file_list *l, file_info *fi) {
+	(void)l;
+	fmt_abstime(out, fi->time);
+}
+
+static void fmt_col_reltime(struct obuf *out, file_list *l, file_info *fi) {
+	(void)l;
+	fmt_reltime(out, fi->time);
+}
+
+static void fmt_col_size(struct obuf *out, file_list *l, file_info *fi) {
+	(void)l;
+	fmt_size(out, fi->size);
+}
+
+static void fmt_plan(void) {
+	int n = 0, w = 0;
+	if (options.strmode) {
+		fmt_columns[n++] = fmt_col_mode;
+		w += 10 + 1;
+	}
+	if (options.userinfo != UINFO_NEVER)
+		fmt_columns[n++] = fmt_col_userinfo;
+	if (options.date == DATE_ABS) {
+		fmt_columns[n++] = fmt_col_abstime;
+		w += 12 + 1;
+	}
+	if (options.date == DATE_REL) {
+		fmt_columns[n++] = fmt_col_reltime;
+		w += 3 + 1;
+		reltime_init();
+	}
+	if (options.size) {
+		fmt_columns[n++] = fmt_col_size;
+		w += 4 + 1;
+	}
+	fmt_ncolumns = n;
+	fmt_columns_width = w;
+}
+
+static int fmt_file_width(file_list *l, file_info *fi) {
+	const file_cold *fc = fi_cold(fi);
+	int w = fmt_columns_width + fc->nwidth;
+	if (l->userinfo)
+		w += fc->uwidth + 1 + fc->gwidth + 1;
+	return w;
+}
+
+static void fmt_file(struct obuf *out, file_list *l, file_info *fi) {
+	for (int i = 0; i < fmt_ncolumns; i++)
+		fmt_columns[i](out, l, fi);
+	fmt_name(out, fi);
+}
+
+// machine readable output, the fields the options ask for straight from
+// file_info; names are paths below v->dir when several directories are listed
+static bool output_paths;
+
+// --binary record, in host byte order and followed by the name and the target
+// of a symlink without terminators; the fields the options do not ask for are
+// 0, the mode always has the file type
+struct lsc_record {
+	uint64_t ino;
+	int64_t size, time;
+	uint32_t len; // of the whole record
+	uint32_t mode, uid, gid;
+	uint32_t name_len, target_len;
+};
+
+static const char *fmt_type_name(mode_t m) {
+	switch (m&S_IFMT) {
+	case S_IFREG:  return "file";
+	case S_IFDIR:  return "dir";
+	case S_IFLNK:  return "link";
+	case S_IFIFO:  return "fifo";
+	case S_IFSOCK: return "sock";
+	case S_IFCHR:  return "char";
+	case S_IFBLK:  return "block";
+	default:       return "unknown";
+	}
+}
+
+// json string contents; a byte that is not part of valid utf-8 is written as
+// the code point of the same value, \u0080 to \u00ff, and false is returned
+// so the exact bytes can follow in base64
+static bool fmt_json_str(struct obuf *out, const char *s, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	bool exact = true;
+	size_t run = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c >= 0x80) {
+			wchar_t wc;
+			size_t n = utf8_decode(s + i, len - i, &wc);
+			if (n <= 4) {
+				i += n - 1;
+				continue;
+			}
+			exact = false;
+		} else if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		ob_write(out, s + run, i - run);
+		run = i + 1;
+		if (c == '"' || c == '\\') {
+			char e[2] = { '\\', c };
+			ob_write(out, e, 2);
+		} else {
+			char e[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+			ob_write(out, e, 6);
+		}
+	}
+	ob_write(out, s + run, len - run);
+	return exact;
+}
+
+// base64 with padding of the bytes of a followed by those of b
+static void fmt_base64(struct obuf *out, const char *a, size_t alen,
+	const char *b, size_t blen)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t len = alen + blen;
+	for (size_t i = 0; i < len; i += 3) {
+		uint32_t v = 0;
+		for (size_t k = i; k < i + 3; k++) {
+			unsigned char c = k >= len ? 0 : k < alen ? a[k] : b[k - alen];
+			v = v << 8 | c;
+		}
+		char e[4] = {
+			digits[v >> 18], digits[v >> 12 & 63],
+			i + 1 < len ? digits[v >> 6 & 63] : '=',
+			i + 2 < len ? digits[v & 63] : '=',
+		};
+		ob_write(out, e, 4);
+	}
 }
 
-static void fmt_name(FILE *out, const file_info *fi) {
-	int t;
-	const char *c;
-	if (fi->linkname && options.follow_links) {
-		t = fi->linkok ? color_type(fi->linkmode) : L_ORPHAN;
-		c = file_color(fi->linkname, fi->linkname_len, t);
-	} else {
-		t = color_type(fi->mode);
-		c = file_color(fi->name, fi->name_len, t);
+static void fmt_json(struct obuf *out, const file_info *fi, const char *dir,
+	size_t dir_len)
+{
+	const file_cold *fc = fi_cold(fi);
+	ob_lit(out, "{\"name\":\"");
+	bool exact = fmt_json_str(out, dir, dir_len);
+	exact &= fmt_json_str(out, fi->name, fi->name_len);
+	if (!exact) {
+		ob_lit(out, "\",\"name_base64\":\"");
+		fmt_base64(out, dir, dir_len, fi->name, fi->name_len);
 	}
-	fputs(C_ESC, out);
-	fputs(c ? c : "0", out);
-	fputs("m", out);
-	fwrite(fi->name, 1, fi->name_len, out);
-	if (c) fputs(C_END, out);
-	if (options.follow_links && fi->linkname) {
-		fputs(" " C_SYM_DELIM_COLOR C_SYM_DELIM C_ESC, out);
-		fputs(c ? c : "0", out);
-		fputs("m", out);
-		fwrite(fi->linkname, 1, fi->linkname_len, out);
-		if (c) fputs(C_END, out);
+	ob_lit(out, "\",\"type\":\"");
+	ob_puts(out, fmt_type_name(fi->mode));
+	ob_lit(out, "\",\"ino\":");
+	ob_uint(out, fc->ino);
+	if (options.strmode) {
+		ob_lit(out, ",\"mode\":");
+		ob_uint(out, fi->mode & 07777);
 	}
-	if (!options.no_classify) {
-		mode_t m = fi->linkname && options.follow_links ? fi->linkmode : fi->mode;
-		if (S_ISREG(m) && m&S_IXUGO) fputs(CL_EXEC, out);
-		else if S_ISDIR(m) fputs(CL_DIR, out);
-		else if S_ISLNK(m) fputs(CL_LINK, out);
-		else if S_ISFIFO(m) fputs(CL_FIFO, out);
-		else if S_ISSOCK(m) fputs(CL_SOCK, out);
+	if (options.userinfo != UINFO_NEVER) {
+		ob_lit(out, ",\"uid\":");
+		ob_uint(out, fc->uid);
+		ob_lit(out, ",\"gid\":");
+		ob_uint(out, fc->gid);
+	}
+	if (options.date != DATE_NONE) {
+		ob_lit(out, ",\"time\":");
+		ob_int(out, fi->time);
+	}
+	if (options.size) {
+		ob_lit(out, ",\"size\":");
+		ob_int(out, fi->size);
+	}
+	if (fc->linkname) {
+		ob_lit(out, ",\"target\":\"");
+		if (!fmt_json_str(out, fc->linkname, fc->linkname_len)) {
+			ob_lit(out, "\",\"target_base64\":\"");
+			fmt_base64(out, fc->linkname, fc->linkname_len, 0, 0);
+		}
+		ob_putc(out, '"');
 	}
+	ob_lit(out, "}\n");
 }
 
-static void fmt_usergroup(FILE *out, id_t id, const char *n, int w, int mw) {
-	if (n) fputs(n, out);
-	else fprintf(out, "%d", id);
-	for (int n = mw - w + 1; n--;)
-		putc(' ', out);
+static void fmt_binary(struct obuf *out, const file_info *fi, const char *dir,
+	size_t dir_len)
+{
+	const file_cold *fc = fi_cold(fi);
+	size_t target_len = fc->linkname ? fc->linkname_len : 0;
+	struct lsc_record r = {
+		.ino = fc->ino, .size = fi->size, .time = fi->time,
+		.mode = fi->mode, .uid = fc->uid, .gid = fc->gid,
+		.name_len = dir_len + fi->name_len, .target_len = target_len,
+	};
+	r.len = sizeof(r) + r.name_len + target_len;
+	ob_write(out, &r, sizeof(r));
+	ob_write(out, dir, dir_len);
+	ob_write(out, fi->name, fi->name_len);
+	if (target_len) ob_write(out, fc->linkname, target_len);
 }
 
-static void fmt_userinfo(FILE *out, file_list *l, file_info *fi) {
-	fputs(C_USERINFO, out);
-	fmt_usergroup(out, fi->uid, getuser(fi->uid), fi->uwidth, l->uwidth);
-	fmt_usergroup(out, fi->gid, getgroup(fi->gid), fi->gwidth, l->gwidth);
+// records for the entries [begin, v->len), in output order if sorted is set
+static void fmt_records(struct obuf *out, file_list *v, size_t begin,
+	bool sorted)
+{
+	char *dir = 0;
+	size_t dir_len = 0;
+	if (output_paths && v->dir) {
+		dir_len = strlen(v->dir);
+		dir = xmalloc(dir_len + 2, 1);
+		memcpy(dir, v->dir, dir_len);
+		if (dir_len && dir[dir_len - 1] != '/') dir[dir_len++] = '/';
+	}
+	for (size_t i = begin; i < v->len; i++) {
+		file_info *fi = sorted ? fv_sorted(v, i) : fv_index(v, i);
+		switch (options.output) {
+		case OUTPUT_PRINT0:
+			ob_write(out, dir, dir_len);
+			ob_write(out, fi->name, fi->name_len);
+			ob_putc(out, '\0');
+			break;
+		case OUTPUT_JSON: fmt_json(out, fi, dir, dir_len); break;
+		case OUTPUT_BINARY: fmt_binary(out, fi, dir, dir_len); break;
+		case OUTPUT_TERM: break;
+		}
+	}
+	free(dir);
 }
 
-static int fmt_file_width(file_list *l, file_info *fi) {
-	int w = 0;
-	if (options.strmode)
-		w += 10 + 1;
-	if (l->userinfo)
-		w += fi->uwidth + 1 + fi->gwidth + 1;
-	if (options.date == DATE_ABS)
-		w += 12 + 1;
-	if (options.date == DATE_REL)
-		w += 3 + 1;
-	if (options.size)
-		w += 4 + 1;
-	return w + fi->nwidth;
+struct grid { int *columns, x, y; };
+
+// range maximum over the widths, a bottom-up segment tree so that a column
+// of the column major layout costs O(log n)
+struct range_max { int *t; size_t n; };
+
+static void rm_init(struct range_max *m, const int *w, size_t n) {
+	m->n = n;
+	m->t = xmalloc(n, 2 * sizeof(int));
+	memcpy(m->t + n, w, n * sizeof(int));
+	for (size_t i = n - 1; i > 0; i--)
+		m->t[i] = MAX(m->t[2 * i], m->t[2 * i + 1]);
 }
 
-static void fmt_file(FILE *out, file_list *l, file_info *fi) {
-	if (options.strmode)
-		fmt_strmode(out, fi->mode);
-	if (l->userinfo)
-		fmt_userinfo(out, l, fi);
-	if (options.date == DATE_ABS)
-		fmt_abstime(out, fi->time);
-	if (options.date == DATE_REL)
-		fmt_reltime(out, fi->time);
-	if (options.size)
-		fmt_size(out, fi->size);
-	fmt_name(out, fi);
+// maximum of [l, r)
+static int rm_query(const struct range_max *m, size_t l, size_t r) {
+	int res = 0;
+	for (l += m->n, r += m->n; l < r; l >>= 1, r >>= 1) {
+		if (l & 1) { res = MAX(res, m->t[l]); l++; }
+		if (r & 1) { r--; res = MAX(res, m->t[r]); }
+	}
+	return res;
 }
 
-struct grid { int *columns, x, y; };
+// maximum width in each of c columns of r rows, gives up as soon as the
+// columns are wider than avail
+static bool grid_columns(int *cols, int c, int r, int direction, int avail,
+	const int *widths, size_t widths_len, const struct range_max *rm)
+{
+	long total = 0;
+	if (!direction && rm) {
+		for (int ci = 0; ci < c; ci++) {
+			size_t l = (size_t)ci * r;
+			cols[ci] = rm_query(rm, l, MIN(l + r, widths_len));
+			if ((total += cols[ci]) > avail) return false;
+		}
+		return true;
+	}
+	memset(cols, 0, c * sizeof(*cols));
+	for (size_t i = 0; i < widths_len; i++) {
+		int ci = direction ? i % c : i / r;
+		if (widths[i] <= cols[ci]) continue;
+		total += widths[i] - cols[ci];
+		cols[ci] = widths[i];
+		if (total > avail) return false;
+	}
+	return true;
+}
 
 bool grid_layout(struct grid *g, int direction, int padding, int term_width,
 	int max_width, int *widths, size_t widths_len)
 {
 	g->columns = 0;
-	int *cols = 0;
+	if (!widths_len) return false;
+	int *cols = 0, best_c = 0, best_r = 0;
+	struct range_max rm = {0};
 	// iterate through numbers of rows, starting at upper bound
 	int n = (term_width - max_width) / (padding + max_width) + 1;
 	int upper_bound = (widths_len + n - 1) / n + 1;
@@ -702,110 +3006,941 @@ bool grid_layout(struct grid *g, int direction, int padding, int term_width,
 		int c = (widths_len + r - 1) / r;
 		// skip uninteresting rows
 		r = ((widths_len + c - 1) / c);
-		// total padding between columns
-		int total_separator_width = (c - 1) * padding;
-		// find maximum width in each column
-		cols = xrealloc(cols, c, sizeof(*cols));
-		memset(cols, 0, c * sizeof(*cols));
-		for (size_t i = 0; i < widths_len; i++) {
-			int ci = direction ? i % c : i / r;
-			cols[ci] = MAX(cols[ci], widths[i]);
-		}
-		// calculate total width of columns
-		int total = 0;
-		for (int i = 0; i < c; i++) total += cols[i];
-		// check if columns fit
-		if (total > term_width - total_separator_width)
-			break;
-		// store last layout that fits
-		int *tmp = g->columns;
-		g->columns = cols, cols = tmp;
-		g->x = c;
-		g->y = r;
+		// width left for the columns after the padding between them
+		int avail = term_width - (c - 1) * padding;
+		// columns at most max_width wide fit without looking at them,
+		// otherwise find the maximum width in each column
+		if ((long)c * max_width > avail) {
+			cols = xrealloc(cols, c, sizeof(*cols));
+			if (!direction && !rm.t) rm_init(&rm, widths, widths_len);
+			if (!grid_columns(cols, c, r, direction, avail, widths,
+			    widths_len, &rm))
+				break;
+		}
+		// remember last layout that fits
+		best_c = c;
+		best_r = r;
 	}
-	if (cols) free(cols);
+	if (best_c) {
+		g->columns = xmalloc(best_c, sizeof(*g->columns));
+		grid_columns(g->columns, best_c, best_r, direction, INT_MAX,
+			widths, widths_len, rm.t ? &rm : 0);
+		g->x = best_c;
+		g->y = best_r;
+	}
+	free(cols);
+	free(rm.t);
 	return !!g->columns;
 }
 
-static void fmt_file_list(FILE *out, file_list *v) {
+static void fmt_id_width(file_list *v, file_info *fi) {
+	file_cold *fc = fi_cold(fi);
+	fc->uwidth = getuser(fc->uid)->width;
+	fc->gwidth = getgroup(fc->gid)->width;
+	v->uwidth = MAX(fc->uwidth, v->uwidth);
+	v->gwidth = MAX(fc->gwidth, v->gwidth);
+}
+
+// print the entries [begin, v->len) one per line and drop them; the user and
+// group columns only ever grow since later entries are not known yet
+static void fmt_stream(struct obuf *out, file_list *v, size_t begin) {
+	uint64_t t = prof_start();
+	if (options.output) fmt_records(out, v, begin, false);
+	else for (size_t i = begin; i < v->len; i++) {
+		file_info *fi = fv_index(v, i);
+		if (v->userinfo) fmt_id_width(v, fi);
+		fmt_file(out, v, fi);
+		ob_putc(out, '\n');
+	}
+	prof_count(PROF_ENTRIES, v->len - begin);
+	prof_end(PROF_FORMAT, t);
+	v->flushed += v->len - begin;
+	v->len = begin;
+	if (!begin) arena_reset(&v->arena);
+	ob_flush(out);
+}
+
+// width of the terminal, or $COLUMNS when the output goes elsewhere
+static int term_columns(void) {
+	struct winsize w;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) return w.ws_col;
+	const char *p = getenv("COLUMNS");
+	char *end;
+	long n = p ? strtol(p, &end, 10) : 0;
+	return n > 0 && !*end && n <= INT_MAX ? n : 80;
+}
+
+static void fmt_file_list(struct obuf *out, file_list *v) {
+	uint64_t t = prof_start();
+	prof_count(PROF_ENTRIES, v->len);
+	if (options.output) {
+		fmt_records(out, v, 0, true);
+		prof_end(PROF_FORMAT, t);
+		return;
+	}
 	if (v->userinfo)
-		for (size_t i = 0; i < v->len; i++) {
-			file_info *fi = fv_index(v, i);
-			const char *u = getuser(fi->uid);
-			const char *g = getgroup(fi->gid);
-			fi->uwidth = u ? strwidth(u) : snprintf(0, 0, "%d", fi->uid);
-			fi->gwidth = g ? strwidth(g) : snprintf(0, 0, "%d", fi->gid);
-			v->uwidth = MAX(fi->uwidth, v->uwidth);
-			v->gwidth = MAX(fi->gwidth, v->gwidth);
-		}
-	if (options.layout == LAYOUT_1LINE)
+		for (size_t i = 0; i < v->len; i++)
+			fmt_id_width(v, fv_sorted(v, i));
+	if (options.layout == LAYOUT_1LINE) {
+		prof_end(PROF_WIDTH, t);
 		goto oneline;
+	}
 	int *widths = xmalloc(v->len, sizeof(int)), max_width = 0;
 	for (size_t i = 0; i < v->len; i++) {
-		file_info *fi = fv_index(v, i);
-		fi->nwidth = fmt_name_width(fi);
+		file_info *fi = fv_sorted(v, i);
+		fi_cold(fi)->nwidth = fmt_name_width(fi);
 		widths[i] = fmt_file_width(v, fi);
 		max_width = MAX(max_width, widths[i]);
 	}
-	struct winsize w;
-	int term_width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 ? 80 : w.ws_col;
+	prof_end(PROF_WIDTH, t);
+	int term_width = term_columns();
 	if (term_width < max_width) {
 		free(widths);
 		goto oneline;
 	}
 	int direction = options.layout == LAYOUT_GRID_LINES, padding = 2;
 	struct grid g = {0};
+	t = prof_start();
 	bool grid = grid_layout(&g, direction, padding, term_width,
 		max_width, widths, v->len);
+	prof_end(PROF_LAYOUT, t);
 	if (!grid) goto oneline;
+	t = prof_start();
 	for (int y = 0; y < g.y; y++) {
 		for (int x = 0; x < g.x; x++) {
 			int i = direction ? y * g.x + x : g.y * x + y;
 			if ((size_t)i >= v->len) continue;
-			file_info *fi = fv_index(v, i);
+			file_info *fi = fv_sorted(v, i);
 			fmt_file(out, v, fi);
 			if (x != g.x - 1) {
-				int p = g.columns[x] - widths[i] + padding;
-				while (p--) putc(' ', out);
+				ob_pad(out, g.columns[x] - widths[i] + padding);
 			}
-			fi_free(fi);
 		}
-		putc('\n', out);
+		ob_putc(out, '\n');
 	}
 	free(g.columns);
 	free(widths);
 	goto end;
 oneline:
+	t = prof_start();
 	for (size_t i = 0; i < v->len; i++) {
-		file_info *fi = fv_index(v, i);
+		file_info *fi = fv_sorted(v, i);
 		fmt_file(out, v, fi);
-		fi_free(fi);
-		putc('\n', out);
+		ob_putc(out, '\n');
 	}
 end:
-	if (options.stats)
-		fprintf(out, "%zu\n", v->len);
+	prof_end(PROF_FORMAT, t);
+	if (options.stats) {
+		ob_int(out, v->len + v->flushed);
+		ob_putc(out, '\n');
+	}
+}
+
+// --files-from and --files0-from: every path read is listed as the entry it
+// names, like an operand with -I, in one list that is sorted and printed once.
+// The paths are grouped by their parent directory, which is opened once so
+// that its paths are statted relative to it in a batch instead of being
+// resolved from the start each
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+struct path_group {
+	char *key; // parent with its trailing slash, "" for paths statted whole
+	size_t len;
+	const char **paths;
+	size_t n, cap;
+};
+
+struct path_groups {
+	struct path_group *g; // in order of appearance
+	size_t n, cap;
+	uint32_t *map; // index + 1 of the group by key, open addressing
+	size_t mask;
+	size_t last; // group of the previous path, paths tend to come in runs
+};
+
+static uint32_t *pg_slot(struct path_groups *gs, const char *key, size_t len) {
+	size_t i = lsc_hash(key, len) & gs->mask;
+	for (; gs->map[i]; i = (i + 1) & gs->mask) {
+		const struct path_group *g = &gs->g[gs->map[i] - 1];
+		if (g->len == len && !memcmp(g->key, key, len)) break;
+	}
+	return &gs->map[i];
+}
+
+static void pg_add(struct path_groups *gs, const char *key, size_t len,
+	const char *path)
+{
+	struct path_group *g = gs->n ? &gs->g[gs->last] : 0;
+	if (!g || g->len != len || memcmp(g->key, key, len)) {
+		if (2 * (gs->n + 1) > gs->mask + 1) {
+			size_t slots = gs->map ? 2 * (gs->mask + 1) : 64;
+			free(gs->map);
+			gs->map = calloc(slots, sizeof(*gs->map));
+			assertx(gs->map);
+			gs->mask = slots - 1;
+			for (size_t i = 0; i < gs->n; i++)
+				*pg_slot(gs, gs->g[i].key, gs->g[i].len) = i + 1;
+		}
+		uint32_t *slot = pg_slot(gs, key, len);
+		if (!*slot) {
+			if (gs->n == gs->cap) {
+				gs->cap = MAX(16, gs->cap * 2);
+				gs->g = xrealloc(gs->g, gs->cap, sizeof(*gs->g));
+			}
+			g = &gs->g[gs->n++];
+			*g = (struct path_group){ .key = xmalloc(len + 1, 1), .len = len };
+			memcpy(g->key, key, len);
+			g->key[len] = '\0';
+			*slot = gs->n;
+		}
+		gs->last = *slot - 1;
+		g = &gs->g[gs->last];
+	}
+	if (g->n == g->cap) {
+		g->cap = MAX(16, g->cap * 2);
+		g->paths = xrealloc(g->paths, g->cap, sizeof(*g->paths));
+	}
+	g->paths[g->n++] = path;
+}
+
+// stat the paths of g into v
+static int pg_stat(file_list *v, struct path_group *g) {
+	int dirfd = AT_FDCWD, err = 0;
+	if (g->len) {
+		dirfd = open(g->key, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (dirfd == -1) {
+			int e = errno;
+			for (size_t i = 0; i < g->n; i++) {
+				errno = e;
+				warn_errno("cannot access '%s'", g->paths[i]);
+			}
+			return -1;
+		}
+	}
+	size_t begin = v->len;
+	for (size_t i = 0; i < g->n; i++) {
+		file_info *fi = fv_stage(v);
+		fi->name = g->paths[i] + g->len;
+		*fi_cold(fi) = (file_cold){ .type = DT_UNKNOWN };
+		fv_commit(v);
+	}
+	// the key without its slash names the parent in warnings
+	if (g->len) g->key[g->len - 1] = '\0';
+	err = ls_stat_all(v, begin, dirfd, g->len ? g->key : 0, false);
+	if (dirfd != AT_FDCWD) close(dirfd);
+	// list the paths as they were given
+	for (size_t i = begin; i < v->len; i++) {
+		file_info *fi = fv_index(v, i);
+		fi->name -= g->len;
+		fi->name_len += g->len;
+		fi->name_suf = suf_index(fi->name, fi->name_len);
+	}
+	return err;
+}
+
+// read the paths separated by delim from path, '-' for stdin
+static int ls_files_from(file_list *v, const char *path, int delim) {
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) die_errno("cannot open '%s'", path);
+	struct path_groups gs = {0};
+	char *line = 0;
+	size_t cap = 0;
+	ssize_t n;
+	int err = 0;
+	while ((n = getdelim(&line, &cap, delim, f)) != -1) {
+		if (n && line[n - 1] == delim) line[--n] = '\0';
+		if (!n) {
+			warn("%s", "invalid zero-length file name");
+			err = -1;
+			continue;
+		}
+		const char *p = arena_strndup(&v->arena, line, n);
+		// a/b is statted as b in a/; a, a/ and / are statted whole
+		const char *slash = memrchr(p, '/', n);
+		size_t len = slash && slash[1] ? (size_t)(slash - p) + 1 : 0;
+		pg_add(&gs, p, len, p);
+	}
+	if (ferror(f)) die_errno("cannot read '%s'", path);
+	free(line);
+	if (f != stdin) fclose(f);
+	for (size_t i = 0; i < gs.n; i++) {
+		err |= pg_stat(v, &gs.g[i]);
+		free(gs.g[i].key);
+		free(gs.g[i].paths);
+	}
+	free(gs.g);
+	free(gs.map);
+	return err;
+}
+
+// several operands and recursive listings: the operands and their
+// subdirectories are read, statted and rendered by a pool of threads, each
+// takes work from the back of its own queue and steals from the front of the
+// others'; the main thread prints the rendered listings in argument order,
+// subdirectories in pre-order, as they complete
+struct tree_dir {
+	struct tree_dir *parent; // 0 for operands
+	char *path; // for the header and messages
+	const char *name; // in path, relative to the parent
+	struct ls_dir dir;
+	int refs; // kids that still have to open themselves, +1 while reading
+	struct obuf out; // rendered listing
+	struct tree_dir **kids; // in output order
+	size_t nkids;
+	int err;
+	bool done;
+};
+
+struct tree_queue {
+	pthread_mutex_t lock;
+	struct tree_dir **items;
+	size_t head, tail, cap;
+};
+
+struct tree_pool {
+	struct tree_queue *queues;
+	int n;
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // work was queued or everything is done
+	pthread_cond_t done; // the directory the printer waits for is done
+	struct tree_dir *waiting;
+	long queued, pending; // queued, and queued or being read
+};
+
+struct tree_worker {
+	struct tree_pool *pool;
+	int id;
+	file_list v;
+};
+
+static void tq_push(struct tree_queue *q, struct tree_dir *d) {
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		if (q->head) {
+			memmove(q->items, q->items + q->head,
+				(q->tail - q->head) * sizeof(*q->items));
+			q->tail -= q->head;
+			q->head = 0;
+		} else {
+			q->cap = MAX(q->cap * 2, 16);
+			q->items = xrealloc(q->items, q->cap, sizeof(*q->items));
+		}
+	}
+	q->items[q->tail++] = d;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static struct tree_dir *tq_pop(struct tree_queue *q, bool back) {
+	struct tree_dir *d = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		d = back ? q->items[--q->tail] : q->items[q->head++];
+		if (q->head == q->tail) q->head = q->tail = 0;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return d;
+}
+
+static void tree_push(struct tree_pool *t, int id, struct tree_dir *d) {
+	tq_push(&t->queues[id], d);
+	pthread_mutex_lock(&t->lock);
+	t->queued++;
+	t->pending++;
+	pthread_cond_signal(&t->wake);
+	pthread_mutex_unlock(&t->lock);
+}
+
+// next directory for worker id, 0 once all are done
+static struct tree_dir *tree_take(struct tree_pool *t, int id) {
+	for (;;) {
+		struct tree_dir *d = tq_pop(&t->queues[id], true);
+		for (int i = 1; !d && i < t->n; i++)
+			d = tq_pop(&t->queues[(id + i) % t->n], false);
+		pthread_mutex_lock(&t->lock);
+		if (d) {
+			t->queued--;
+			pthread_mutex_unlock(&t->lock);
+			return d;
+		}
+		while (t->queued <= 0 && t->pending)
+			pthread_cond_wait(&t->wake, &t->lock);
+		bool end = !t->pending;
+		pthread_mutex_unlock(&t->lock);
+		if (end) return 0;
+	}
+}
+
+static void tree_finish(struct tree_pool *t, struct tree_dir *d) {
+	pthread_mutex_lock(&t->lock);
+	d->done = true;
+	if (t->waiting == d) pthread_cond_signal(&t->done);
+	if (!--t->pending) pthread_cond_broadcast(&t->wake);
+	pthread_mutex_unlock(&t->lock);
+}
+
+// drop a reference to the descriptor of d
+static void tree_release(struct tree_dir *d) {
+	if (!__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL))
+		ld_close(&d->dir);
+}
+
+// queue the subdirectories of d from its sorted listing v, the first one ends
+// up at the back of the queue so that it is read first
+static void tree_kids(struct tree_pool *t, int id, struct tree_dir *d,
+	file_list *v)
+{
+	for (size_t i = 0; i < v->len; i++)
+		d->nkids += S_ISDIR(fv_sorted(v, i)->mode);
+	d->refs = d->nkids + 1;
+	d->kids = xmalloc(d->nkids, sizeof(*d->kids));
+	size_t dl = strlen(d->path), k = 0;
+	bool slash = dl && d->path[dl - 1] == '/';
+	for (size_t i = 0; i < v->len; i++) {
+		file_info *fi = fv_sorted(v, i);
+		if (!S_ISDIR(fi->mode)) continue;
+		struct tree_dir *kid = xmalloc(1, sizeof(*kid));
+		*kid = (struct tree_dir){ .parent = d };
+		kid->path = xmalloc(dl + !slash + fi->name_len + 1, 1);
+		memcpy(kid->path, d->path, dl);
+		kid->path[dl] = '/';
+		kid->name = kid->path + dl + !slash;
+		memcpy((char *)kid->name, fi->name, fi->name_len + 1);
+		d->kids[k++] = kid;
+	}
+	for (size_t i = d->nkids; i--;)
+		tree_push(t, id, d->kids[i]);
+	tree_release(d);
+}
+
+static void tree_operand(struct tree_worker *w, struct tree_dir *d) {
+	file_list *v = &w->v;
+	d->err = ls(v, d->path, 0, true);
+	fv_sort(v);
+	fmt_file_list(&d->out, v);
+	// not a directory, or already reported by ls
+	if (options.recursive && !options.dir &&
+	    ld_open(&d->dir, AT_FDCWD, d->path) == 0)
+		tree_kids(w->pool, w->id, d, v);
+}
+
+static void tree_read(struct tree_worker *w, struct tree_dir *d) {
+	ob_init(&d->out, -1);
+	fv_clear(&w->v);
+	if (!d->parent) {
+		tree_operand(w, d);
+		return;
+	}
+	int r = ld_open(&d->dir, d->parent->dir.fd, d->name);
+	if (r == -1) warn_errno("cannot open directory '%s'", d->path);
+	tree_release(d->parent);
+	if (r == -1) {
+		d->err = -1;
+		return;
+	}
+	file_list *v = &w->v;
+	v->dir = d->path;
+	d->err = ls_entries(v, &d->dir, d->path, 0, true);
+	fv_sort(v);
+	fmt_file_list(&d->out, v);
+	tree_kids(w->pool, w->id, d, v);
+}
+
+static void *tree_worker(void *p) {
+	struct tree_worker *w = p;
+	struct tree_dir *d;
+	while ((d = tree_take(w->pool, w->id))) {
+		tree_read(w, d);
+		tree_finish(w->pool, d);
+	}
+	ld_exit();
+	return 0;
+}
+
+// print the subdirectories of d and free them
+static int tree_print(struct tree_pool *t, struct obuf *out,
+	struct tree_dir *d)
+{
+	int err = 0;
+	for (size_t i = 0; i < d->nkids; i++) {
+		struct tree_dir *k = d->kids[i];
+		pthread_mutex_lock(&t->lock);
+		t->waiting = k;
+		while (!k->done) pthread_cond_wait(&t->done, &t->lock);
+		t->waiting = 0;
+		pthread_mutex_unlock(&t->lock);
+		if (!options.output) {
+			if (k->parent || i) ob_putc(out, '\n');
+			ob_puts(out, k->path);
+			ob_lit(out, ":\n");
+		}
+		ob_write(out, k->out.buf, k->out.len);
+		free(k->out.buf);
+		err |= k->err;
+		err |= tree_print(t, out, k);
+		free(k->kids);
+		free(k->path);
+		free(k);
+	}
+	return err;
+}
+
+// list the n operands in paths
+static int ls_pool(struct obuf *out, char **paths, int n, file_list *v) {
+	struct tree_pool t = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.wake = PTHREAD_COND_INITIALIZER,
+		.done = PTHREAD_COND_INITIALIZER,
+	};
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	t.n = options.jobs ? options.jobs : MIN(MAX(cpus, 1) * 4, STAT_THREADS_MAX);
+	// without -R there is nothing to steal beyond the operands
+	if (!options.recursive) t.n = MIN(t.n, n);
+	t.queues = xmalloc(t.n, sizeof(*t.queues));
+	struct tree_worker *ws = xmalloc(t.n, sizeof(*ws));
+	pthread_t *tids = xmalloc(t.n, sizeof(*tids));
+	for (int i = 0; i < t.n; i++) {
+		t.queues[i] = (struct tree_queue){
+			.lock = PTHREAD_MUTEX_INITIALIZER };
+		ws[i] = (struct tree_worker){ .pool = &t, .id = i };
+		fv_init(&ws[i].v);
+		ws[i].v.uid = v->uid;
+		ws[i].v.gid = v->gid;
+	}
+	// operands go round-robin to the queues, the first ones at the backs
+	struct tree_dir root = { .nkids = n };
+	root.kids = xmalloc(n, sizeof(*root.kids));
+	for (int i = 0; i < n; i++) {
+		struct tree_dir *d = xmalloc(1, sizeof(*d));
+		*d = (struct tree_dir){ .path = xmalloc(strlen(paths[i]) + 1, 1) };
+		strcpy(d->path, paths[i]);
+		d->name = d->path;
+		root.kids[i] = d;
+	}
+	for (int i = n; i--;)
+		tree_push(&t, i % t.n, root.kids[i]);
+	int started = 0;
+	for (; started < t.n; started++)
+		if (pthread_create(&tids[started], 0, tree_worker, &ws[started]))
+			break;
+	if (!started) die_errno("%s", "cannot create threads");
+	int err = tree_print(&t, out, &root);
+	free(root.kids);
+	for (int i = 0; i < started; i++)
+		pthread_join(tids[i], 0);
+	for (int i = 0; i < t.n; i++) {
+		fv_free(&ws[i].v);
+		free(t.queues[i].items);
+	}
+	free(t.queues);
+	free(ws);
+	free(tids);
+	return err;
+}
+
+#ifdef HAVE_INOTIFY
+// --watch: the listing of one directory stays on the terminal and follows the
+// inotify events of the directory. A changed entry is statted alone, found by
+// name through a hash table and moved within v->sorted by binary search, and
+// the screen is repainted from the first row that changed. Slots and names of
+// entries that went away are reclaimed by reading the directory again once
+// they outnumber the live entries
+#define WATCH_BUF (64 * 1024)
+#define WATCH_SLACK 1024 // garbage allowed on top of the live entries
+#define WATCH_MAP_MIN 64
+
+// number of entries by width, keeps the maximum as entries come and go
+struct width_hist { size_t *n; int cap, max; };
+
+static void wh_add(struct width_hist *h, int w) {
+	if (w >= h->cap) {
+		int cap = MAX(w + 1, h->cap * 2);
+		h->n = xrealloc(h->n, cap, sizeof(*h->n));
+		memset(h->n + h->cap, 0, (cap - h->cap) * sizeof(*h->n));
+		h->cap = cap;
+	}
+	h->n[w]++;
+	h->max = MAX(h->max, w);
+}
+
+static void wh_del(struct width_hist *h, int w) {
+	h->n[w]--;
+	while (h->max > 0 && !h->n[h->max]) h->max--;
+}
+
+struct watch {
+	file_list v;
+	size_t n; // live entries, v->sorted[0, n)
+	size_t garbage; // entries and names no longer referenced
+	file_info **map; // live entries by name, open addressing
+	size_t mask;
+	struct width_hist users, groups;
+	size_t foreign; // entries not owned by the user and group of lsc
+	const char *path;
+	int dirfd; // only open while events are handled, -1 otherwise
+	int rows;
+	size_t dirty; // first row to repaint
+	bool full; // repaint everything
+};
+
+static size_t wm_home(const struct watch *w, const char *name) {
+	return lsc_hash(name, strlen(name)) & w->mask;
+}
+
+// slot of the entry called name, or the empty slot it would go into
+static file_info **wm_slot(struct watch *w, const char *name) {
+	size_t i = wm_home(w, name);
+	while (w->map[i] && strcmp(w->map[i]->name, name))
+		i = (i + 1) & w->mask;
+	return &w->map[i];
+}
+
+// an empty table with room for n entries
+static void wm_init(struct watch *w, size_t n) {
+	size_t slots = WATCH_MAP_MIN;
+	while (slots < 2 * n) slots *= 2;
+	free(w->map);
+	w->map = calloc(slots, sizeof(*w->map));
+	assertx(w->map);
+	w->mask = slots - 1;
+}
+
+// w->n counts fi already
+static void wm_put(struct watch *w, file_info *fi) {
+	if (2 * w->n > w->mask + 1) {
+		file_info **old = w->map;
+		size_t slots = w->mask + 1;
+		w->map = 0;
+		wm_init(w, w->n);
+		for (size_t i = 0; i < slots; i++)
+			if (old[i]) *wm_slot(w, old[i]->name) = old[i];
+		free(old);
+	}
+	*wm_slot(w, fi->name) = fi;
+}
+
+// empty the slot, moving back the entries that probed past it
+static void wm_del(struct watch *w, file_info **slot) {
+	size_t i = slot - w->map, j = i;
+	for (;;) {
+		j = (j + 1) & w->mask;
+		if (!w->map[j]) break;
+		size_t k = wm_home(w, w->map[j]->name);
+		if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			w->map[i] = w->map[j];
+			i = j;
+		}
+	}
+	w->map[i] = 0;
+}
+
+// index of fi in v->sorted, or the index it goes to
+static size_t watch_find(struct watch *w, const file_info *fi) {
+	size_t l = 0, r = w->n;
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+		if (fi_cmp(fv_sorted(&w->v, m), fi) < 0) l = m + 1;
+		else r = m;
+	}
+	return l;
+}
+
+// add (d = 1) or remove (d = -1) fi from the column widths
+static void watch_account(struct watch *w, file_info *fi, int d) {
+	if (options.userinfo == UINFO_NEVER) return;
+	file_cold *fc = fi_cold(fi);
+	if (d > 0) {
+		fc->uwidth = getuser(fc->uid)->width;
+		fc->gwidth = getgroup(fc->gid)->width;
+		wh_add(&w->users, fc->uwidth);
+		wh_add(&w->groups, fc->gwidth);
+	} else {
+		wh_del(&w->users, fc->uwidth);
+		wh_del(&w->groups, fc->gwidth);
+	}
+	w->foreign += d * (fc->uid != w->v.uid || fc->gid != w->v.gid);
+}
+
+// apply the column widths, returns whether they changed
+static bool watch_widths(struct watch *w) {
+	file_list *v = &w->v;
+	bool userinfo = options.userinfo == UINFO_ALWAYS ||
+		(options.userinfo == UINFO_AUTO && w->foreign);
+	if (userinfo == v->userinfo && (!userinfo ||
+	    (v->uwidth == w->users.max && v->gwidth == w->groups.max)))
+		return false;
+	v->userinfo = userinfo;
+	v->uwidth = w->users.max;
+	v->gwidth = w->groups.max;
+	return true;
+}
+
+static void watch_dirty(struct watch *w, size_t row) {
+	w->dirty = MIN(w->dirty, row);
+}
+
+// read the whole directory again
+static int watch_load(struct watch *w) {
+	file_list *v = &w->v;
+	struct ls_dir d;
+	fv_clear(v);
+	if (ld_open(&d, AT_FDCWD, w->path) == -1) {
+		warn_errno("cannot open directory '%s'", w->path);
+		return -1;
+	}
+	int err = ls_entries(v, &d, w->path, 0, false);
+	ld_close(&d);
+	fv_sort(v);
+	w->n = v->len;
+	w->garbage = w->foreign = 0;
+	w->users.max = w->groups.max = 0;
+	if (w->users.n) memset(w->users.n, 0, w->users.cap * sizeof(size_t));
+	if (w->groups.n) memset(w->groups.n, 0, w->groups.cap * sizeof(size_t));
+	wm_init(w, w->n);
+	for (size_t i = 0; i < w->n; i++) {
+		file_info *fi = fv_sorted(v, i);
+		*wm_slot(w, fi->name) = fi;
+		watch_account(w, fi, 1);
+	}
+	v->userinfo = false;
+	v->uwidth = v->gwidth = -1;
+	watch_widths(w);
+	w->full = true;
+	return err;
+}
+
+// bring the entry called name up to date
+static void watch_update(struct watch *w, const char *name) {
+	if (ls_skip(name, strlen(name))) return;
+	file_list *v = &w->v;
+	file_info **slot = wm_slot(w, name), *fi = *slot;
+	uint32_t id;
+	if (fi) {
+		size_t i = watch_find(w, fi);
+		assertx(i < w->n && fv_sorted(v, i) == fi);
+		id = v->sorted[i];
+		memmove(v->sorted + i, v->sorted + i + 1,
+			(w->n - i - 1) * sizeof(*v->sorted));
+		w->n--;
+		watch_dirty(w, i);
+		watch_account(w, fi, -1);
+		wm_del(w, slot);
+	} else {
+		id = v->len;
+		fi = fv_stage(v);
+		fv_commit(v);
+		fi->name = arena_strndup(&v->arena, name, strlen(name));
+	}
+	fi_cold(fi)->type = DT_UNKNOWN;
+	if (ls_stat(fi, &v->arena, w->dirfd, stat_need) == -1) {
+		w->garbage++; // gone
+		return;
+	}
+	w->garbage += !!fi_cold(fi)->linkname;
+	if (w->n == v->sorted_cap) {
+		v->sorted_cap = MAX(16, v->sorted_cap * 2);
+		v->sorted = xrealloc(v->sorted, v->sorted_cap, sizeof(*v->sorted));
+	}
+	size_t i = watch_find(w, fi);
+	memmove(v->sorted + i + 1, v->sorted + i,
+		(w->n - i) * sizeof(*v->sorted));
+	v->sorted[i] = id;
+	w->n++;
+	watch_dirty(w, i);
+	watch_account(w, fi, 1);
+	wm_put(w, fi);
+}
+
+static int watch_rows(void) {
+	struct winsize ws;
+	return ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || !ws.ws_row ? 24 :
+		ws.ws_row;
+}
+
+// the first rows entries, from the dirty row down
+static void watch_paint(struct watch *w, struct obuf *out) {
+	if (w->full) {
+		w->dirty = 0;
+		ob_lit(out, "\033[H");
+	} else if (w->dirty >= (size_t)w->rows) {
+		return;
+	} else {
+		ob_lit(out, "\033[");
+		ob_int(out, w->dirty + 1);
+		ob_lit(out, ";1H");
+	}
+	ob_lit(out, "\033[J");
+	size_t end = MIN(w->n, (size_t)w->rows);
+	for (size_t i = w->dirty; i < end; i++) {
+		fmt_file(out, &w->v, fv_sorted(&w->v, i));
+		if (i + 1 < end) ob_putc(out, '\n');
+	}
+	ob_flush(out);
+	w->dirty = SIZE_MAX;
+	w->full = false;
+}
+
+static volatile sig_atomic_t watch_signal;
+
+static void watch_on_signal(int sig) { watch_signal = sig; }
+
+static int ls_watch(struct obuf *out, const char *path) {
+	struct watch w = { .path = path, .dirfd = -1, .dirty = SIZE_MAX };
+	fv_init(&w.v);
+	w.v.uid = getuid();
+	w.v.gid = getgid();
+	if (!isatty(STDOUT_FILENO)) die("%s", "--watch needs a terminal");
+	int fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (fd == -1) die_errno("%s", "cannot watch");
+	// entry changes that only stat can see are followed when they are shown
+	uint32_t mask = IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|
+		IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR|IN_EXCL_UNLINK;
+	if (stat_need) mask |= IN_ATTRIB|IN_MODIFY|IN_CLOSE_WRITE;
+	if (inotify_add_watch(fd, path, mask) == -1)
+		die_errno("cannot watch '%s'", path);
+	// signals are only taken while waiting for events
+	sigset_t block, wait;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &block, &wait);
+	struct sigaction sa = { .sa_handler = watch_on_signal };
+	for (int i = 1; i < NSIG; i++)
+		if (sigismember(&block, i)) sigaction(i, &sa, 0);
+	char *buf = xmalloc(WATCH_BUF, 1);
+	ob_lit(out, "\033[?1049h\033[?7l"); // alternate screen, no wrapping
+	w.rows = watch_rows();
+	int err = watch_load(&w);
+	for (bool done = false, reload = false; !done;) {
+		if (reload || w.garbage > w.n + WATCH_SLACK) {
+			err |= watch_load(&w);
+			reload = false;
+		}
+		if (watch_widths(&w)) w.full = true;
+		watch_paint(&w, out);
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (ppoll(&pfd, 1, 0, &wait) == -1) {
+			if (errno != EINTR) { warn_errno("%s", "poll"); err = -1; break; }
+			if (watch_signal != SIGWINCH) break;
+			watch_signal = 0;
+			w.rows = watch_rows();
+			w.full = true;
+			continue;
+		}
+		get_current_time(); // for the entries about to be statted
+		// an open directory would only send IN_DELETE_SELF once it is
+		// closed, so it is not kept open while waiting
+		ssize_t n;
+		while ((n = read(fd, buf, WATCH_BUF)) > 0) {
+			const struct inotify_event *e;
+			for (char *p = buf; p < buf + n; p += sizeof(*e) + e->len) {
+				e = (const void *)p;
+				if (e->mask & IN_Q_OVERFLOW)
+					reload = true; // events were lost
+				else if (e->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+					done = true;
+				else if (e->len && w.dirfd == -1 && (w.dirfd =
+				    open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+					done = true; // gone before IN_DELETE_SELF
+				else if (e->len)
+					watch_update(&w, e->name);
+			}
+		}
+		if (w.dirfd != -1) {
+			close(w.dirfd);
+			w.dirfd = -1;
+		}
+		if (n == -1 && errno != EAGAIN) {
+			warn_errno("cannot watch '%s'", path);
+			err = -1;
+			break;
+		}
+	}
+	ob_lit(out, "\033[?7h\033[?1049l");
+	sigprocmask(SIG_SETMASK, &wait, 0);
+	free(buf);
+	free(w.map);
+	free(w.users.n);
+	free(w.groups.n);
+	fv_free(&w.v);
+	close(fd);
+	return err;
+}
+#endif
+
+static const char *const prof_phases[] = {
+	"read", "stat", "readlink", "ids", "sort", "width", "layout", "format",
+	"flush",
+};
+
+static const char *const prof_counters[] = {
+	"entries", "stat_calls", "readlink_calls", "nss_misses",
+	"lsc_lookups", "bytes_written", "allocations", "cache_hits",
+	"cache_misses",
+};
+
+// phases are summed over threads and nest: ids happen during width and
+// format, flushes of full buffers during format
+static void prof_report(uint64_t wall) {
+	if (options.profile == PROFILE_JSON) {
+		fprintf(stderr, "{\"wall_ms\":%.3f,\"phases_ms\":{", wall / 1e6);
+		for (int i = 0; i < PROF_PHASES; i++)
+			fprintf(stderr, "%s\"%s\":%.3f", i ? "," : "", prof_phases[i],
+				prof.ns[i] / 1e6);
+		fprintf(stderr, "},\"counters\":{");
+		for (int i = 0; i < PROF_COUNTERS; i++)
+			fprintf(stderr, "%s\"%s\":%llu", i ? "," : "", prof_counters[i],
+				(unsigned long long)prof.n[i]);
+		fprintf(stderr, "}}\n");
+		return;
+	}
+	log("%-16s %12.3f ms", "wall", wall / 1e6);
+	for (int i = 0; i < PROF_PHASES; i++)
+		log("%-16s %12.3f ms", prof_phases[i], prof.ns[i] / 1e6);
+	for (int i = 0; i < PROF_COUNTERS; i++)
+		log("%-16s %12llu", prof_counters[i], (unsigned long long)prof.n[i]);
 }
 
 void usage(void) {
 	log("usage: %s [option ...] [file ...]"
 		"\n  -a  show all files"
 		"\n  -I  do not open directories"
+		"\n  -R  list subdirectories recursively"
 		"\n  -c  print stats"
+		"\n  --profile[=json]  print time per phase and counters to stderr"
+		"\n  --cache  keep directory entries in $XDG_CACHE_HOME/lsc"
+		"\n  --head N  list only the first N files of each directory"
+		"\n  --ignore PATTERN  do not list entries matching PATTERN"
+		"\n  --only PATTERN  list only entries matching PATTERN"
+		"\n  --ignore-file FILE  read --ignore patterns from FILE, one per line"
+		"\n  --files-from FILE  list the paths in FILE, one per line (- for stdin)"
+		"\n  --files0-from FILE  list the paths in FILE, terminated by NUL"
+		"\n  --watch  follow changes to a directory, one file per line"
+		"\n  --print0  print names terminated by NUL"
+		"\n  --json  print a JSON object per file, with the fields of -m -u -d -z -y"
+		"\n  --binary  print a binary record per file, see struct lsc_record"
+		"\n  -j N  stat with N threads (default: automatic)"
+		"\n  -b  batch stat calls through io_uring, if available"
 		"\n  -M  use mtime instead of ctime"
 		"\n  -G  do not group directories first"
 		"\n  -r  reverse sort"
 		"\n  -s  sort by file size"
 		"\n  -t  sort by mtime/ctime"
+		"\n  -f  do not sort, stream the listing with -1 and -l"
 		"\n  -1  list one file per line"
 		"\n  -g  show output in grid, by columns (default)"
 		"\n  -x  show output in grid, by lines"
 		"\n  -m  print file modes"
 		"\n  -u  print user and group info (automatic)"
 		"\n  -U  print user and group info (always)"
+		"\n  -P  read all users and groups at once when there are many"
 		"\n  -d  print relative modification time"
 		"\n  -D  print absolute modification time"
 		"\n  -z  print file size"
+		"\n  -S  print disk usage, of everything below for directories"
 		"\n  -y  print symlink target"
 		"\n  -F  do not print type indicator"
 		"\n  -l  long format (equivalent to -1mudzy)"
@@ -813,18 +3948,54 @@ void usage(void) {
 		, program_name);
 }
 
+enum {
+	OPT_PROFILE = 256, OPT_CACHE, OPT_WATCH, OPT_PRINT0, OPT_JSON, OPT_BINARY,
+	OPT_HEAD, OPT_IGNORE, OPT_ONLY, OPT_IGNORE_FILE, OPT_FILES_FROM,
+	OPT_FILES0_FROM,
+};
+
+static const struct option long_options[] = {
+	{ "profile", optional_argument, 0, OPT_PROFILE },
+	{ "cache", no_argument, 0, OPT_CACHE },
+	{ "watch", no_argument, 0, OPT_WATCH },
+	{ "print0", no_argument, 0, OPT_PRINT0 },
+	{ "json", no_argument, 0, OPT_JSON },
+	{ "binary", no_argument, 0, OPT_BINARY },
+	{ "head", required_argument, 0, OPT_HEAD },
+	{ "ignore", required_argument, 0, OPT_IGNORE },
+	{ "only", required_argument, 0, OPT_ONLY },
+	{ "ignore-file", required_argument, 0, OPT_IGNORE_FILE },
+	{ "files-from", required_argument, 0, OPT_FILES_FROM },
+	{ "files0-from", required_argument, 0, OPT_FILES0_FROM },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 },
+};
+
 int main(int argc, char **argv) {
-	setlocale(LC_ALL, "");
+	uint64_t start = prof_clock();
 	int c;
-	while ((c = getopt(argc, argv, ":aIcMGrst1gxmdDuUzFylh")) != -1)
+	while ((c = getopt_long(argc, argv, ":aIRcj:bMGrstf1gxmdDuUPzSFylh",
+	    long_options, 0)) != -1)
 		switch (c) {
 		case 'a': options.all = true; break;
 		case 'I': options.dir = true; break;
+		case 'R': options.recursive = true; break;
 		case 'c': options.stats = true; break;
+		case 'j': {
+			char *end;
+			errno = 0;
+			long n = strtol(optarg, &end, 10);
+			if (*end || errno || n < 1 || n > STAT_THREADS_MAX)
+				die("invalid number of jobs -- '%s'", optarg);
+			options.jobs = n;
+			break;
+		}
+		case 'b': options.uring = true; break;
 		case 'M': options.m_time = true; break;
 		case 'G': options.no_group_dir = true; break;
 		case 's': options.sort = SORT_SIZE; break;
 		case 't': options.sort = SORT_TIME; break;
+		case 'f': options.unsorted = true; break;
 		case 'r': options.reverse = true; break;
 		case '1': options.layout = LAYOUT_1LINE; break;
 		case 'g': options.layout = LAYOUT_GRID_COLUMNS; break;
@@ -832,9 +4003,11 @@ int main(int argc, char **argv) {
 		case 'm': options.strmode = true; break;
 		case 'u': options.userinfo = UINFO_AUTO; break;
 		case 'U': options.userinfo = UINFO_ALWAYS; break;
+		case 'P': options.preload = true; break;
 		case 'd': options.date = DATE_REL; break;
 		case 'D': options.date = DATE_ABS; break;
 		case 'z': options.size = true; break;
+		case 'S': options.size = options.du = true; break;
 		case 'F': options.no_classify = true; break;
 		case 'y': options.follow_links = true; break;
 		case 'l':
@@ -845,31 +4018,132 @@ int main(int argc, char **argv) {
 			options.follow_links = true;
 			options.size = true;
 			break;
+		case OPT_PROFILE:
+			if (!optarg || !strcmp(optarg, "text"))
+				options.profile = PROFILE_TEXT;
+			else if (!strcmp(optarg, "json"))
+				options.profile = PROFILE_JSON;
+			else
+				die("invalid profile format -- '%s'", optarg);
+			break;
+		case OPT_CACHE: options.cache = true; break;
+		case OPT_WATCH:
+#ifndef HAVE_INOTIFY
+			die("%s", "--watch is not supported on this system");
+#endif
+			options.watch = true;
+			break;
+		case OPT_PRINT0: options.output = OUTPUT_PRINT0; break;
+		case OPT_JSON: options.output = OUTPUT_JSON; break;
+		case OPT_BINARY: options.output = OUTPUT_BINARY; break;
+		case OPT_HEAD: {
+			char *end;
+			long long n = strtoll(optarg, &end, 10);
+			if (*end || n < 1) die("invalid number of files -- '%s'", optarg);
+			options.head = n;
+			break;
+		}
+		case OPT_IGNORE: globs_add(&ignore_globs, optarg); break;
+		case OPT_ONLY: globs_add(&only_globs, optarg); break;
+		case OPT_IGNORE_FILE: globs_read(&ignore_globs, optarg); break;
+		case OPT_FILES_FROM:
+			options.files_from = optarg;
+			options.files_delim = '\n';
+			break;
+		case OPT_FILES0_FROM:
+			options.files_from = optarg;
+			options.files_delim = '\0';
+			break;
 		case 'h': usage(); return 0;
 		case '?':
-			warn("invalid option -- '%c'", optopt);
+			if (optopt) warn("invalid option -- '%c'", optopt);
+			else warn("invalid option -- '%s'", argv[optind - 1]);
+			log("try '%s -h' for more information", program_name);
+			return 2;
+		case ':':
+			// optopt is the value of long options, above any char
+			if (optopt < 256)
+				warn("option requires an argument -- '%c'", optopt);
+			else
+				warn("option requires an argument -- '%s'", argv[optind - 1]);
 			log("try '%s -h' for more information", program_name);
 			return 2;
 		default: return -1;
 		}
-	lsc_parse(getenv("LS_COLORS"));
+	prof.on = options.profile != PROFILE_NONE;
+	if (options.files_from) {
+		if (optind < argc)
+			die("%s", "file operands cannot be combined with --files-from");
+		if (options.recursive || options.watch || options.head)
+			die("%s", "--files-from lists no directories");
+	}
+	if (options.watch) {
+		if (options.output) die("%s", "--watch prints to a terminal");
+		if (options.head) die("%s", "--watch lists the whole directory");
+		if (options.du) die("%s", "--watch does not walk subdirectories");
+		// rows are repainted in place, in sorted order
+		options.layout = LAYOUT_1LINE;
+		options.unsorted = false;
+	}
+	if (options.output) {
+		// names are not classified, coloured or measured
+		options.no_classify = true;
+	} else {
+		setlocale(LC_ALL, "");
+		utf8_locale = !strcmp(nl_langinfo(CODESET), "UTF-8");
+		init_strwidth();
+		lsc_parse(getenv("LS_COLORS"));
+	}
+	if (options.cache) dc_init();
+	stat_plan();
+	if (!options.output) fmt_plan();
+	init_name_rank();
 	get_current_time();
+	struct obuf out;
+	ob_init(&out, STDOUT_FILENO);
+	// recursion needs the listing of the operand to find its subdirectories
+	struct obuf *stream = options.unsorted && !options.recursive &&
+		(options.layout == LAYOUT_1LINE || options.output) ? &out : 0;
 	file_list v = {0};
-	fv_init(&v, 64);
+	fv_init(&v);
 	v.uid = getuid();
 	v.gid = getgid();
+	int err = 0;
+	if (options.files_from) {
+		err |= ls_files_from(&v, options.files_from,
+			options.files_delim) == -1;
+		fv_sort(&v);
+		fmt_file_list(&out, &v);
+		goto end;
+	}
 	if (optind >= argc) argv[--optind] = ".";
-	int err = 0, arg_num = argc - optind;
+	int arg_num = argc - optind;
+	output_paths = arg_num > 1 || options.recursive;
+#ifdef HAVE_INOTIFY
+	if (options.watch) {
+		if (arg_num != 1) die("%s", "--watch takes one directory");
+		err |= ls_watch(&out, argv[optind]) == -1;
+		goto end;
+	}
+#endif
+	if ((arg_num > 1 && !stream) || options.recursive) {
+		err |= ls_pool(&out, argv + optind, arg_num, &v) == -1;
+		goto end;
+	}
 	for (int i = 0; i < arg_num; i++) {
 		char *path = argv[optind + i];
-		err |= ls(&v, path) == -1;
-		qsort(v.data, v.len, sizeof(*v.data), fi_cmp);
-		if (arg_num > 1) {
-			if (i) putchar('\n');
-			printf("%s:\n", path);
+		if (arg_num > 1 && !options.output) {
+			if (i) ob_putc(&out, '\n');
+			ob_puts(&out, path);
+			ob_lit(&out, ":\n");
 		}
-		fmt_file_list(stdout, &v);
+		err |= ls(&v, path, stream, false) == -1;
+		fv_sort(&v);
+		fmt_file_list(&out, &v);
 		fv_clear(&v);
 	};
+end:
+	ob_flush(&out);
+	if (prof.on) prof_report(prof_clock() - start);
 	return err;
 }
@@ -0,0 +1,54 @@
+#!/bin/sh
+# check the totals of -S against du, run through make check
+#
+#   LSC      binary to check (./lsc)
+#   REPEAT   runs per case, the totals may not depend on which walk gets
+#            somewhere first (20)
+
+set -e
+lsc=$(realpath "${LSC:-./lsc}")
+repeat=${REPEAT:-20}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# a big file linked from two subtrees, and a directory under both operands
+mkdir -p p/c/g p/e/f
+head -c 409600 /dev/urandom > p/c/g/big
+ln p/c/g/big p/e/hard
+echo x > p/e/f/small
+
+fail=0
+# lsc -S with the given operands has to print the directory sizes in want
+check() { # want operands...
+	want=$1
+	shift
+	i=0
+	while [ $i -lt "$repeat" ]; do
+		got=$("$lsc" -S --json -j 8 "$@" |
+			sed -n 's/.*"name":"\([^"]*\)","type":"dir".*"size":\([0-9]*\).*/\1 \2/p')
+		if [ "$got" != "$want" ]; then
+			printf 'lsc -S %s:\n%s\nwant:\n%s\n' "$*" "$got" "$want" >&2
+			fail=1
+			return
+		fi
+		i=$((i + 1))
+	done
+}
+# name and du size of the directories given, counted as one du run
+sizes() { # strip dirs...
+	strip=$1
+	shift
+	du -s -B1 "$@" | while read -r size name; do
+		echo "${name#$strip} $size"
+	done
+}
+
+check "$(sizes p/ p/c p/e)" p
+check "$(sizes '' p/c/g; sizes '' p/c p/e)" p/c p
+check "$(sizes '' p/c p/e; sizes '' p/c/g)" p p/c
+# reversed, the link still goes to the first in name order
+check "$(sizes p/ p/c p/e | sort -r)" -r p
+# each operand is a listing of its own
+check "$(sizes '' p/e; sizes '' p/c)" -I p/e p/c
+exit $fail
@@ -0,0 +1,46 @@
+#!/bin/sh
+# check --only and --ignore against find -name, run through make check
+#
+#   LSC   binary to check (./lsc)
+#
+# find lets wildcards match the leading period of a dotfile, lsc does not, so
+# dotfiles are only expected where the pattern starts with a period
+
+set -e
+lsc=$(realpath "${LSC:-./lsc}")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+for name in a ab ba abc aab b.c b.h c.o file1.txt file10.txt fileA.txt \
+    x.tar.gz tar.gz 'x*y' xzy '*star' star 'q?' qq 'br[ack' '[x' 'a\b' \
+    'sp ace' -dash Z9 9 é.txt café .a .ab .hidden .tar.gz '.*'; do
+	touch "./$name"
+done
+
+fail=0
+# lsc --only or --ignore with pattern has to list what find lists
+check() { # only|ignore pattern
+	mode=$1
+	pat=$2
+	got=$(LS_COLORS= "$lsc" -1 -F -a "--$mode" "$pat" . |
+		sed 's/\x1b\[[0-9;]*m//g' | LC_ALL=C sort)
+	case $pat in
+	.*) set -- -name "$pat" ;;
+	*) set -- ! -name '.*' -name "$pat" ;;
+	esac
+	[ "$mode" = only ] || set -- ! \( "$@" \)
+	want=$(find . -mindepth 1 "$@" | sed 's|^\./||' | LC_ALL=C sort)
+	if [ "$got" != "$want" ]; then
+		printf 'lsc --%s %s:\n%s\nwant:\n%s\n' "$mode" "$pat" "$got" "$want" >&2
+		fail=1
+	fi
+}
+
+for pat in '*' '**' a 'a*' '*a' '*a*' 'a*b' '*.tar.gz' 'file?.txt' '*.[ch]' \
+    '[!a-m]*' '[a-c]?*' '[[]*' '*[0-9]' '\*star' '*\?' 'x[*]y' 'x\*y' \
+    'a\b' '*é*' '.*' '.a*' '.*z' '?' '??' '*?*'; do
+	check only "$pat"
+	check ignore "$pat"
+done
+exit $fail
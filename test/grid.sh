@@ -0,0 +1,58 @@
+#!/bin/sh
+# check the grid layouts against test/grid.out, run through make check
+#
+#   LSC      binary to check (./lsc)
+#   UPDATE   write test/grid.out instead of comparing to it
+#
+# test/grid.out comes from the build before the layout on range maxima,
+# which tried every column count in turn; COLUMNS sets the width as the
+# output is not a terminal
+
+set -e
+lsc=$(realpath "${LSC:-./lsc}")
+expected=$(realpath "$(dirname "$0")")/grid.out
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# names of uneven widths, a few of them long
+mkdir few some many one
+for n in a bb ccc dddd eeeee; do touch "few/$n"; done
+touch one/only
+i=0
+while [ $i -lt 150 ]; do
+	len=$((i * 7919 % 23 + 1))
+	[ $((i % 50)) = 0 ] && len=$((len + 12))
+	name=$(printf '%03d%*s' $i $len '' | tr ' ' x)
+	touch "many/$name"
+	[ $i -lt 16 ] && touch "some/$name"
+	i=$((i + 1))
+done
+
+grid() { # columns dirs...
+	cols=$1
+	shift
+	for layout in -g -x; do
+		for d in "$@"; do
+			echo "== $cols $layout $d"
+			COLUMNS=$cols LS_COLORS= "$lsc" -F $layout $d |
+				sed 's/\x1b\[[0-9;]*m//g'
+		done
+	done
+}
+
+# every width from the widest name of some on, where layouts just fit or
+# not, and a few for the others
+out=$(cols=26
+while [ $cols -le 80 ]; do
+	grid $cols few some
+	cols=$((cols + 1))
+done
+for cols in 1 80 160 1000; do
+	grid $cols many one
+done)
+if [ "$UPDATE" ]; then
+	echo "$out" > "$expected"
+	exit
+fi
+echo "$out" | diff -u "$expected" - >&2
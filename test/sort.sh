@@ -0,0 +1,47 @@
+#!/bin/sh
+# check the order of listings against test/sort.out, run through make check
+#
+#   LSC      binary to check (./lsc)
+#   UPDATE   write test/sort.out instead of comparing to it
+#
+# test/sort.out comes from the build before the radix sort on fi_key, which
+# ordered everything with fi_cmp; the fixture is larger than SORT_RADIX_MIN
+# and has names, sizes and times, some before 1970, that share their keys
+
+set -e
+lsc=$(realpath "${LSC:-./lsc}")
+expected=$(realpath "$(dirname "$0")")/sort.out
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+i=0
+for base in a A b B file File FILE file_ file. x.tar.gz longcommonprefix_ \
+    .a .A .file é 日 '~' -; do
+	for suf in '' 0 1 2 7 007 010 10 1.2 1.10 99999999999999999999 \
+	    099999999999999999998 '~' .~1~ a Z .txt; do
+		i=$((i + 1))
+		name=$base$suf
+		if [ $((i % 7)) = 0 ]; then
+			mkdir "./$name"
+		else
+			head -c $((i * 37 % 50)) /dev/zero > "./$name"
+		fi
+		touch -d "@$(((i * 13 % 40 - 20) * 4000000))" "./$name"
+	done
+done
+
+# names only, without colours
+list() {
+	LS_COLORS= "$lsc" -1 -F -a -M "$@" . | sed 's/\x1b\[[0-9;]*m//g'
+}
+
+out=$(for opts in '' -r -t -tr -s -sr -G -Gt -Gsr; do
+	echo "== $opts"
+	list $opts
+done)
+if [ "$UPDATE" ]; then
+	echo "$out" > "$expected"
+	exit
+fi
+echo "$out" | diff -u "$expected" - >&2
@@ -0,0 +1,50 @@
+#!/bin/sh
+# check name widths against test/width.out, run through make check
+#
+#   LSC      binary to check (./lsc)
+#   UPDATE   write test/width.out instead of comparing to it
+#
+# test/width.out comes from the build before the vectorized ascii scan,
+# which measured names a byte at a time; the names put a wide or multibyte
+# character at every offset of the first 16 and 32 byte blocks of the scan
+# and the ones after them
+
+set -e
+lsc=$(realpath "${LSC:-./lsc}")
+expected=$(realpath "$(dirname "$0")")/width.out
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# a run of ascii, then c, then more ascii so the name ends in another block
+names() { # dir c
+	i=0
+	while [ $i -le 72 ]; do
+		name=$(printf '%*s' $i '' | tr ' ' a)$2$(printf '%*s' $((i % 9)) '' |
+			tr ' ' b)
+		touch "$1/$name"
+		i=$((i + 1))
+	done
+}
+mkdir latin cjk emoji mixed
+names latin é
+names cjk 日
+names emoji 😀
+names mixed é日
+touch mixed/日本語のファイル名 mixed/"$(printf '%*s' 31 '' | tr ' ' c)"
+
+export LC_ALL=C.UTF-8
+out=$(for cols in 200 300; do
+	for layout in -g -x; do
+		for d in latin cjk emoji mixed; do
+			echo "== $cols $layout $d"
+			COLUMNS=$cols LS_COLORS= "$lsc" -F $layout $d |
+				sed 's/\x1b\[[0-9;]*m//g'
+		done
+	done
+done)
+if [ "$UPDATE" ]; then
+	echo "$out" > "$expected"
+	exit
+fi
+echo "$out" | diff -u "$expected" - >&2